@@ -0,0 +1,622 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+#include <libsoup/soup.h>
+
+#include "adblock.h"
+
+
+struct FilterList
+{
+    GHashTable *hosts;
+    GHashTable *tokens;
+    GPtrArray *generic;
+};
+
+struct FilterRequest
+{
+    const gchar *uri;
+    gchar *lower;
+    gchar *host;
+    gsize host_start;
+    gchar *page_host;
+    gboolean page_only;
+    gboolean third_party;
+    guint type;
+};
+
+struct FilterRule
+{
+    gchar *pattern;
+    GRegex *re;
+    gboolean host_anchored;
+    gboolean match_case;
+    gboolean page;
+    gint third_party;
+    guint types;
+    gchar **domains;
+};
+
+
+static GSList *adblock_patterns = NULL;
+static struct FilterList filter_allow, filter_block;
+
+static const struct
+{
+    const gchar *name;
+    guint type;
+} filter_types[] = {
+    { "document", ADBLOCK_DOCUMENT },
+    { "font", ADBLOCK_FONT },
+    { "image", ADBLOCK_IMAGE },
+    { "media", ADBLOCK_MEDIA },
+    { "object", ADBLOCK_OBJECT },
+    { "other", ADBLOCK_OTHER },
+    { "ping", ADBLOCK_OTHER },
+    { "script", ADBLOCK_SCRIPT },
+    { "stylesheet", ADBLOCK_STYLESHEET },
+    { "subdocument", ADBLOCK_SUBDOCUMENT },
+    { "websocket", ADBLOCK_OTHER },
+    { "xmlhttprequest", ADBLOCK_XMLHTTPREQUEST },
+};
+
+
+static gchar *
+uri_host_lower(const gchar *uri, gsize *start)
+{
+    const gchar *s, *e;
+
+    if (uri == NULL || (s = strstr(uri, "://")) == NULL)
+        return NULL;
+
+    s += 3;
+    e = s + strcspn(s, "/?#:");
+    if (start != NULL)
+        *start = s - uri;
+
+    return g_ascii_strdown(s, e - s);
+}
+
+static const gchar *
+base_domain(const gchar *host)
+{
+    const gchar *d;
+
+    /* Fails for IP addresses and unknown suffixes. */
+    d = soup_tld_get_base_domain(host, NULL);
+    return d != NULL ? d : host;
+}
+
+static gboolean
+host_matches(const gchar *host, const gchar *domain)
+{
+    gsize hl = strlen(host), dl = strlen(domain);
+
+    if (hl < dl || strcmp(host + hl - dl, domain) != 0)
+        return FALSE;
+    return hl == dl || host[hl - dl - 1] == '.';
+}
+
+static gboolean
+filter_is_separator(gchar c)
+{
+    return !g_ascii_isalnum(c) && c != '_' && c != '-' && c != '.' &&
+           c != '%';
+}
+
+static gboolean
+filter_glob(const gchar *p, const gchar *t)
+{
+    const gchar *star_p = NULL, *star_t = NULL;
+
+    while (*t != 0)
+    {
+        if (*p == '*')
+        {
+            star_p = ++p;
+            star_t = t;
+        }
+        else if (*p == *t || (*p == '^' && filter_is_separator(*t)))
+        {
+            p++;
+            t++;
+        }
+        else if (star_p != NULL)
+        {
+            p = star_p;
+            t = ++star_t;
+        }
+        else
+            return FALSE;
+    }
+
+    /* A separator also matches the end of the URI. */
+    while (*p == '*' || *p == '^')
+        p++;
+    return *p == 0;
+}
+
+static gboolean
+filter_rule_matches(struct FilterRule *r, struct FilterRequest *req)
+{
+    const gchar *text;
+    gboolean found = FALSE, restricted = FALSE;
+    gsize i;
+
+    if ((r->types & req->type) == 0 || (req->page_only && !r->page))
+        return FALSE;
+    if ((r->third_party == 1 && !req->third_party) ||
+        (r->third_party == -1 && req->third_party))
+        return FALSE;
+
+    /* Rules that only list exclusions apply everywhere else. */
+    for (i = 0; r->domains != NULL && r->domains[i] != NULL; i++)
+    {
+        if (r->domains[i][0] == '~')
+        {
+            if (host_matches(req->page_host, r->domains[i] + 1))
+                return FALSE;
+        }
+        else
+        {
+            restricted = TRUE;
+            found = found || host_matches(req->page_host, r->domains[i]);
+        }
+    }
+    if (restricted && !found)
+        return FALSE;
+
+    if (r->re != NULL)
+        return g_regex_match(r->re, req->uri, 0, NULL);
+
+    text = r->match_case ? req->uri : req->lower;
+    if (!r->host_anchored)
+        return filter_glob(r->pattern, text);
+
+    /* "||" matches at the beginning of any label of the host name. */
+    for (i = 0; req->host[i] != 0; i++)
+        if ((i == 0 || req->host[i - 1] == '.') &&
+            filter_glob(r->pattern, text + req->host_start + i))
+            return TRUE;
+    return FALSE;
+}
+
+static gboolean
+filter_bucket_matches(GHashTable *table, const gchar *key,
+                      struct FilterRequest *req)
+{
+    GPtrArray *bucket;
+    guint i;
+
+    bucket = g_hash_table_lookup(table, key);
+    if (bucket == NULL)
+        return FALSE;
+
+    for (i = 0; i < bucket->len; i++)
+        if (filter_rule_matches(g_ptr_array_index(bucket, i), req))
+            return TRUE;
+    return FALSE;
+}
+
+static gboolean
+filter_list_matches(struct FilterList *list, struct FilterRequest *req)
+{
+    const gchar *h, *p, *q;
+    gchar token[64];
+    guint i;
+
+    if (list->generic == NULL)
+        return FALSE;
+
+    for (h = req->host; h != NULL; h = strchr(h, '.'))
+    {
+        h += h[0] == '.' ? 1 : 0;
+        if (filter_bucket_matches(list->hosts, h, req))
+            return TRUE;
+    }
+
+    for (p = req->lower; *p != 0; p = q)
+    {
+        for (; *p != 0 && !g_ascii_isalnum(*p); p++);
+        for (q = p; g_ascii_isalnum(*q); q++);
+        if (q - p > 1 && q - p < (gssize)sizeof token)
+        {
+            memcpy(token, p, q - p);
+            token[q - p] = 0;
+            if (filter_bucket_matches(list->tokens, token, req))
+                return TRUE;
+        }
+    }
+
+    for (i = 0; i < list->generic->len; i++)
+        if (filter_rule_matches(g_ptr_array_index(list->generic, i), req))
+            return TRUE;
+
+    return FALSE;
+}
+
+static void
+filter_index(GHashTable *table, gchar *key, struct FilterRule *r)
+{
+    GPtrArray *bucket;
+
+    bucket = g_hash_table_lookup(table, key);
+    if (bucket == NULL)
+    {
+        bucket = g_ptr_array_new();
+        g_hash_table_insert(table, key, bucket);
+    }
+    else
+        g_free(key);
+
+    g_ptr_array_add(bucket, r);
+}
+
+static gchar *
+filter_token(const gchar *pattern, gboolean start_bounded, gboolean end_bounded)
+{
+    const gchar *best = NULL, *p, *q;
+    gsize best_len = 1;
+
+    /* Pick the longest run of letters and digits that is bounded by
+     * anything but a wildcard. It then shows up as a complete token in
+     * every URI this rule matches. */
+    for (p = pattern; *p != 0; p = q)
+    {
+        for (; *p != 0 && !g_ascii_isalnum(*p); p++);
+        for (q = p; g_ascii_isalnum(*q); q++);
+
+        if (q == p || (gsize)(q - p) <= best_len || q - p >= 64)
+            continue;
+        if (p == pattern ? !start_bounded : p[-1] == '*')
+            continue;
+        if (*q == 0 ? !end_bounded : *q == '*')
+            continue;
+        if ((q - p == 4 && strncmp(p, "http", 4) == 0) ||
+            (q - p == 5 && strncmp(p, "https", 5) == 0))
+            continue;
+
+        best = p;
+        best_len = q - p;
+    }
+
+    return best != NULL ? g_strndup(best, best_len) : NULL;
+}
+
+static gboolean
+filter_options(struct FilterRule *r, const gchar *options)
+{
+    gchar **opts, *o;
+    guint include = 0, exclude = 0;
+    gboolean neg, ok = TRUE;
+    gsize i, j;
+
+    opts = g_strsplit(options, ",", -1);
+    for (i = 0; ok && opts[i] != NULL; i++)
+    {
+        o = opts[i];
+        neg = o[0] == '~';
+        o += neg ? 1 : 0;
+
+        if (strcmp(o, "third-party") == 0 || strcmp(o, "3p") == 0)
+            r->third_party = neg ? -1 : 1;
+        else if (strcmp(o, "first-party") == 0 || strcmp(o, "1p") == 0)
+            r->third_party = neg ? 1 : -1;
+        else if (strcmp(o, "match-case") == 0)
+            r->match_case = TRUE;
+        else if (g_str_has_prefix(o, "domain="))
+            r->domains = g_strsplit(o + strlen("domain="), "|", -1);
+        else
+        {
+            for (j = 0; j < G_N_ELEMENTS(filter_types); j++)
+                if (strcmp(o, filter_types[j].name) == 0)
+                    break;
+
+            /* Rules with options we don't know about are dropped
+             * rather than applied too broadly. */
+            if (j == G_N_ELEMENTS(filter_types))
+                ok = FALSE;
+            else if (neg)
+                exclude |= filter_types[j].type;
+            else
+                include |= filter_types[j].type;
+        }
+    }
+    g_strfreev(opts);
+
+    r->page = (include & ADBLOCK_DOCUMENT) != 0;
+    r->types = (include != 0 ? include : ADBLOCK_ALL) & ~exclude;
+    return ok;
+}
+
+static void
+filter_add(const gchar *line)
+{
+    struct FilterList *list = &filter_block;
+    struct FilterRule *r;
+    GString *glob;
+    gchar *pattern, *options, *key = NULL, *s;
+    gboolean start_anchored = FALSE, end_anchored = FALSE;
+    gsize len;
+
+    /* Comments, the header and element hiding rules. */
+    if (line[0] == 0 || line[0] == '!' || line[0] == '[' ||
+        strstr(line, "##") != NULL || strstr(line, "#@#") != NULL ||
+        strstr(line, "#?#") != NULL || strstr(line, "#$#") != NULL)
+        return;
+
+    if (g_str_has_prefix(line, "@@"))
+    {
+        list = &filter_allow;
+        line += 2;
+    }
+
+    r = g_new0(struct FilterRule, 1);
+    pattern = g_strdup(line);
+
+    /* A "$" inside of a regular expression doesn't start options. */
+    options = strrchr(pattern, '$');
+    if (options != NULL && pattern[0] == '/' && options < strrchr(pattern, '/'))
+        options = NULL;
+    if (options != NULL)
+    {
+        *options = 0;
+        if (!filter_options(r, options + 1))
+        {
+            g_free(pattern);
+            g_strfreev(r->domains);
+            g_free(r);
+            return;
+        }
+    }
+    else
+        r->types = ADBLOCK_ALL;
+
+    if (r->domains != NULL)
+        for (len = 0; r->domains[len] != NULL; len++)
+        {
+            s = r->domains[len];
+            r->domains[len] = g_ascii_strdown(s, -1);
+            g_free(s);
+        }
+
+    len = strlen(pattern);
+    if (len > 2 && pattern[0] == '/' && pattern[len - 1] == '/')
+    {
+        pattern[len - 1] = 0;
+        r->re = g_regex_new(pattern + 1,
+                            r->match_case ? 0 : G_REGEX_CASELESS, 0, NULL);
+        if (r->re == NULL)
+        {
+            fprintf(stderr, __NAME__": Could not compile filter: %s\n", line);
+            g_strfreev(r->domains);
+            g_free(r);
+        }
+        else
+            g_ptr_array_add(list->generic, r);
+        g_free(pattern);
+        return;
+    }
+
+    s = pattern;
+    if (g_str_has_prefix(s, "||"))
+    {
+        r->host_anchored = TRUE;
+        s += 2;
+    }
+    else if (s[0] == '|')
+    {
+        start_anchored = TRUE;
+        s++;
+    }
+    len = strlen(s);
+    if (len > 0 && s[len - 1] == '|')
+    {
+        end_anchored = TRUE;
+        s[--len] = 0;
+    }
+    if (!r->match_case)
+        for (len = 0; s[len] != 0; len++)
+            s[len] = g_ascii_tolower(s[len]);
+
+    glob = g_string_new(NULL);
+    if (!r->host_anchored && !start_anchored)
+        g_string_append_c(glob, '*');
+    g_string_append(glob, s);
+    if (!end_anchored)
+        g_string_append_c(glob, '*');
+    r->pattern = g_string_free(glob, FALSE);
+
+    /* Index by host if the host name is given in full, e.g. in
+     * "||ads.example.com^", otherwise by a token of the pattern. Without
+     * a separator after it, "||ads.example.com" also matches
+     * "ads.example.com.evil", so it can't go into the host index. */
+    len = strcspn(s, "/^:|*?");
+    if (r->host_anchored && len > 0 && !r->match_case &&
+        (s[len] == '/' || s[len] == '^' || s[len] == ':' ||
+         (s[len] == 0 && end_anchored)))
+    {
+        filter_index(list->hosts, g_strndup(s, len), r);
+        g_free(pattern);
+        return;
+    }
+
+    if (!r->match_case)
+        key = filter_token(s, r->host_anchored || start_anchored, end_anchored);
+    if (key != NULL)
+        filter_index(list->tokens, key, r);
+    else
+        g_ptr_array_add(list->generic, r);
+
+    g_free(pattern);
+}
+
+static void
+filter_list_init(struct FilterList *list)
+{
+    list->hosts = g_hash_table_new(g_str_hash, g_str_equal);
+    list->tokens = g_hash_table_new(g_str_hash, g_str_equal);
+    list->generic = g_ptr_array_new();
+}
+
+void
+adblock_load(void)
+{
+    GRegex *re = NULL;
+    GError *err = NULL;
+    GIOChannel *channel = NULL;
+    gchar *path = NULL, *buf = NULL;
+
+    path = g_build_filename(g_get_user_config_dir(), __NAME__, "adblock.black",
+                            NULL);
+    channel = g_io_channel_new_file(path, "r", &err);
+    if (channel != NULL)
+    {
+        while (g_io_channel_read_line(channel, &buf, NULL, NULL, NULL)
+               == G_IO_STATUS_NORMAL)
+        {
+            g_strstrip(buf);
+            if (buf[0] != '#')
+            {
+                re = g_regex_new(buf,
+                                 G_REGEX_CASELESS | G_REGEX_OPTIMIZE,
+                                 G_REGEX_MATCH_PARTIAL, &err);
+                if (err != NULL)
+                {
+                    fprintf(stderr, __NAME__": Could not compile regex: %s\n", buf);
+                    g_error_free(err);
+                    err = NULL;
+                }
+                else
+                    adblock_patterns = g_slist_append(adblock_patterns, re);
+            }
+            g_free(buf);
+        }
+        g_io_channel_shutdown(channel, FALSE, NULL);
+    }
+    g_free(path);
+
+    if (err != NULL)
+    {
+        g_error_free(err);
+        err = NULL;
+    }
+
+    path = g_build_filename(g_get_user_config_dir(), __NAME__,
+                            "adblock.filters", NULL);
+    channel = g_io_channel_new_file(path, "r", NULL);
+    if (channel != NULL)
+    {
+        filter_list_init(&filter_allow);
+        filter_list_init(&filter_block);
+
+        while (g_io_channel_read_line(channel, &buf, NULL, NULL, NULL)
+               == G_IO_STATUS_NORMAL)
+        {
+            g_strstrip(buf);
+            filter_add(buf);
+            g_free(buf);
+        }
+        g_io_channel_shutdown(channel, FALSE, NULL);
+        g_io_channel_unref(channel);
+    }
+    g_free(path);
+}
+
+gboolean
+adblock_match(const gchar *uri, const gchar *page_uri, guint type)
+{
+    struct FilterRequest req = {0}, page = {0};
+    GSList *it = adblock_patterns;
+    gboolean blocked = FALSE;
+
+    while (it)
+    {
+        if (g_regex_match((GRegex *)(it->data), uri, 0, NULL))
+        {
+            blocked = TRUE;
+            break;
+        }
+        it = g_slist_next(it);
+    }
+
+    if (filter_block.generic == NULL)
+        return blocked;
+
+    req.uri = uri;
+    req.host = uri_host_lower(uri, &req.host_start);
+    if (req.host == NULL)
+        return blocked;
+    req.lower = g_ascii_strdown(uri, -1);
+    req.page_host = uri_host_lower(page_uri, NULL);
+    if (req.page_host == NULL)
+        req.page_host = g_strdup("");
+    req.third_party = req.page_host[0] != 0 &&
+                      strcmp(base_domain(req.host),
+                             base_domain(req.page_host)) != 0;
+    req.type = type;
+
+    if (!blocked)
+        blocked = filter_list_matches(&filter_block, &req);
+    if (blocked && filter_list_matches(&filter_allow, &req))
+        blocked = FALSE;
+
+    /* "@@...$document" allows everything on matching pages. */
+    if (blocked && req.page_host[0] != 0)
+    {
+        page.uri = page_uri;
+        page.host = uri_host_lower(page_uri, &page.host_start);
+        page.lower = g_ascii_strdown(page_uri, -1);
+        page.page_host = page.host;
+        page.page_only = TRUE;
+        page.type = ADBLOCK_DOCUMENT;
+        if (filter_list_matches(&filter_allow, &page))
+            blocked = FALSE;
+        g_free(page.host);
+        g_free(page.lower);
+    }
+
+    g_free(req.host);
+    g_free(req.lower);
+    g_free(req.page_host);
+
+    return blocked;
+}
+
+guint
+adblock_type_guess(const gchar *uri, const gchar *page_uri)
+{
+    const gchar *ext;
+    gchar *path;
+    guint type = ADBLOCK_OTHER;
+
+    if (page_uri != NULL && strcmp(uri, page_uri) == 0)
+        return ADBLOCK_DOCUMENT;
+
+    /* WebKit doesn't tell us what a request is for, so this has to do. */
+    path = g_strndup(uri, strcspn(uri, "?#"));
+    ext = strrchr(path, '.');
+    if (ext == NULL || strchr(ext, '/') != NULL)
+        type = ADBLOCK_OTHER;
+    else if (strcmp(ext, ".js") == 0 || strcmp(ext, ".mjs") == 0)
+        type = ADBLOCK_SCRIPT;
+    else if (strcmp(ext, ".css") == 0)
+        type = ADBLOCK_STYLESHEET;
+    else if (strcmp(ext, ".png") == 0 || strcmp(ext, ".jpg") == 0 ||
+             strcmp(ext, ".jpeg") == 0 || strcmp(ext, ".gif") == 0 ||
+             strcmp(ext, ".webp") == 0 || strcmp(ext, ".svg") == 0 ||
+             strcmp(ext, ".ico") == 0)
+        type = ADBLOCK_IMAGE;
+    else if (strcmp(ext, ".woff") == 0 || strcmp(ext, ".woff2") == 0 ||
+             strcmp(ext, ".ttf") == 0 || strcmp(ext, ".otf") == 0)
+        type = ADBLOCK_FONT;
+    else if (strcmp(ext, ".mp4") == 0 || strcmp(ext, ".webm") == 0 ||
+             strcmp(ext, ".mp3") == 0 || strcmp(ext, ".ogg") == 0)
+        type = ADBLOCK_MEDIA;
+    else if (strcmp(ext, ".html") == 0 || strcmp(ext, ".htm") == 0)
+        type = ADBLOCK_SUBDOCUMENT;
+    g_free(path);
+
+    return type;
+}
@@ -0,0 +1,28 @@
+#ifndef ADBLOCK_H
+#define ADBLOCK_H
+
+#include <glib.h>
+
+
+/* Resource types as used by filter options like "$script". */
+enum
+{
+    ADBLOCK_DOCUMENT = 1 << 0,
+    ADBLOCK_FONT = 1 << 1,
+    ADBLOCK_IMAGE = 1 << 2,
+    ADBLOCK_MEDIA = 1 << 3,
+    ADBLOCK_OBJECT = 1 << 4,
+    ADBLOCK_OTHER = 1 << 5,
+    ADBLOCK_SCRIPT = 1 << 6,
+    ADBLOCK_STYLESHEET = 1 << 7,
+    ADBLOCK_SUBDOCUMENT = 1 << 8,
+    ADBLOCK_XMLHTTPREQUEST = 1 << 9,
+
+    ADBLOCK_ALL = (1 << 10) - 1,
+};
+
+void adblock_load(void);
+gboolean adblock_match(const gchar *, const gchar *, guint);
+guint adblock_type_guess(const gchar *, const gchar *);
+
+#endif
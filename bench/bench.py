@@ -0,0 +1,283 @@
+#!/usr/bin/env python3
+
+# End-to-end benchmark. Starts a local HTTP server serving canned pages,
+# runs lariza under Xvfb, opens windows through the FIFO and evaluates
+# lariza's trace file. The report is written as JSON.
+
+import argparse
+import http.server
+import json
+import os
+import shutil
+import signal
+import socketserver
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+
+PAGE_IMAGES = 60
+PAGE_SCRIPTS = 10
+PAGE_STYLES = 10
+PAGE_ADS = 20
+
+ADBLOCK_PATTERNS = [
+    r'^https?://[^/]+/ads/',
+    r'/banner[0-9]*\.',
+    r'[?&]utm_[a-z]+=',
+    r'^https?://(www\.)?doubleclick\.net/',
+    r'/track(ing)?\.js',
+] + [r'/adserver%d/' % i for i in range(200)]
+
+PNG = bytes.fromhex(
+    '89504e470d0a1a0a0000000d4948445200000001000000010806000000'
+    '1f15c4890000000d4944415478da63f8cfc0f01f0005000201a5e1d9d4'
+    '0000000049454e44ae426082')
+
+
+def page(n):
+    body = ['<!DOCTYPE html><html><head><title>Page %d</title>' % n]
+    for i in range(PAGE_STYLES):
+        body.append('<link rel="stylesheet" href="/css/%d/%d.css">' % (n, i))
+    for i in range(PAGE_SCRIPTS):
+        body.append('<script src="/js/%d/%d.js"></script>' % (n, i))
+    body.append('</head><body>')
+    for i in range(PAGE_IMAGES):
+        body.append('<p>Paragraph %d <img src="/img/%d/%d.png"></p>' % (i, n, i))
+    for i in range(PAGE_ADS):
+        body.append('<img src="/ads/%d/banner%d.png">' % (n, i))
+    body.append('</body></html>')
+    return '\n'.join(body).encode()
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    def do_GET(self):
+        path = self.path.split('?')[0]
+        if path.startswith('/page/'):
+            data, ctype = page(int(path.split('/')[2])), 'text/html'
+        elif path.endswith('.css'):
+            data, ctype = b'p { margin: 1px; }\n' * 50, 'text/css'
+        elif path.endswith('.js'):
+            data, ctype = b'var x = 1;\n' * 50, 'application/javascript'
+        elif path.endswith('.png'):
+            data, ctype = PNG, 'image/png'
+        else:
+            self.send_error(404)
+            return
+        self.send_response(200)
+        self.send_header('Content-Type', ctype)
+        self.send_header('Content-Length', str(len(data)))
+        self.send_header('Cache-Control', 'no-store')
+        self.end_headers()
+        self.wfile.write(data)
+
+    def log_message(self, *args):
+        pass
+
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+
+
+def now_us():
+    return time.clock_gettime(time.CLOCK_MONOTONIC) * 1e6
+
+
+def descendants(pid):
+    pids = [pid]
+    for p in pids:
+        try:
+            for task in os.listdir('/proc/%d/task' % p):
+                with open('/proc/%d/task/%s/children' % (p, task)) as f:
+                    pids.extend(int(c) for c in f.read().split())
+        except OSError:
+            pass
+    return pids
+
+
+def rss_kb(pids):
+    total = 0
+    for p in pids:
+        try:
+            with open('/proc/%d/status' % p) as f:
+                for line in f:
+                    if line.startswith('VmRSS:'):
+                        total += int(line.split()[1])
+        except OSError:
+            pass
+    return total
+
+
+def read_trace(path):
+    events = []
+    with open(path) as f:
+        for line in f:
+            line = line.strip().rstrip(',')
+            if line.startswith('{'):
+                events.append(json.loads(line))
+    return events
+
+
+def percentiles(values):
+    if not values:
+        return None
+    v = sorted(values)
+    pick = lambda q: v[min(len(v) - 1, int(q * len(v)))]
+    return {
+        'count': len(v),
+        'min': v[0],
+        'p50': pick(0.50),
+        'p90': pick(0.90),
+        'p99': pick(0.99),
+        'max': v[-1],
+    }
+
+
+def flush(browser):
+    # Only lariza and web processes running the extension handle SIGUSR1,
+    # it would kill any other process.
+    for p in descendants(browser.pid):
+        try:
+            if p != browser.pid:
+                with open('/proc/%d/maps' % p) as f:
+                    if 'we_adblock.so' not in f.read():
+                        continue
+            os.kill(p, signal.SIGUSR1)
+        except OSError:
+            pass
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument('--browser', default='./lariza')
+    ap.add_argument('--extension', default='./we_adblock.so')
+    ap.add_argument('--windows', type=int, default=20)
+    ap.add_argument('--timeout', type=float, default=120)
+    ap.add_argument('--output', default='-')
+    args = ap.parse_args()
+
+    tmp = tempfile.mkdtemp(prefix='lariza-bench-')
+    trace = os.path.join(tmp, 'trace.json')
+    config = os.path.join(tmp, 'config', 'lariza')
+    os.makedirs(os.path.join(config, 'web_extensions'))
+    shutil.copy(args.extension, os.path.join(config, 'web_extensions'))
+    with open(os.path.join(config, 'adblock.black'), 'w') as f:
+        f.write('\n'.join(ADBLOCK_PATTERNS) + '\n')
+    runtime = os.path.join(tmp, 'run')
+    os.makedirs(runtime, 0o700)
+
+    server = Server(('127.0.0.1', 0), Handler)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    base = 'http://127.0.0.1:%d' % server.server_address[1]
+
+    xvfb = None
+    env = dict(os.environ)
+    if 'DISPLAY' not in env:
+        display = ':%d' % (90 + os.getpid() % 100)
+        xvfb = subprocess.Popen(['Xvfb', display, '-screen', '0',
+                                 '1280x1024x24', '-nolisten', 'tcp'],
+                                stderr=subprocess.DEVNULL)
+        env['DISPLAY'] = display
+        time.sleep(1)
+    env.update({
+        'XDG_CONFIG_HOME': os.path.join(tmp, 'config'),
+        'XDG_CACHE_HOME': os.path.join(tmp, 'cache'),
+        'XDG_DATA_HOME': os.path.join(tmp, 'data'),
+        'XDG_RUNTIME_DIR': runtime,
+        'LARIZA_CACHE_EPHEMERAL': '1',
+        'LARIZA_FIFO_SUFFIX': 'bench',
+        'LARIZA_TRACE_FILE': trace,
+    })
+
+    fifo = os.path.join(runtime, 'lariza.fifo-bench')
+    browser = subprocess.Popen([args.browser, '-T', 'about:blank'], env=env)
+    report = {}
+    try:
+        deadline = time.monotonic() + args.timeout
+        while not os.path.exists(fifo) or not os.path.exists(trace):
+            if time.monotonic() > deadline or browser.poll() is not None:
+                sys.exit('lariza did not start')
+            time.sleep(0.1)
+        time.sleep(1)
+        rss_before = rss_kb(descendants(browser.pid))
+
+        sent = {}
+        with open(fifo, 'w') as f:
+            for i in range(args.windows):
+                uri = '%s/page/%d?run=%d' % (base, i, os.getpid())
+                sent[uri] = now_us()
+                f.write(uri + '\n')
+                f.flush()
+
+        # Wait until every window has finished loading its page.
+        while True:
+            flush(browser)
+            time.sleep(0.5)
+            events = read_trace(trace)
+            clients = {e['id']: e for e in events
+                       if e['name'] == 'client_new'
+                       and e.get('args', {}).get('arg') in sent}
+            finished = {e['id'] for e in events
+                        if e['name'] == 'load' and e['ph'] == 'e'}
+            if len(clients) == args.windows and set(clients) <= finished:
+                break
+            if time.monotonic() > deadline:
+                report['timed_out'] = True
+                break
+        rss_after = rss_kb(descendants(browser.pid))
+
+        opened = [(c['ts'] - sent[c['args']['arg']]) / 1e3
+                  for c in clients.values()]
+        loads = []
+        for id, c in clients.items():
+            ends = [e['ts'] for e in events if e['name'] == 'load'
+                    and e['ph'] == 'e' and e['id'] == id]
+            if ends:
+                loads.append((min(ends) - c['ts']) / 1e3)
+
+        # Matching spans of the web extension, per process and thread.
+        open_spans, matches = {}, []
+        for e in events:
+            if e['cat'] != 'adblock' or e['name'] != 'match':
+                continue
+            key = (e['pid'], e['tid'])
+            if e['ph'] == 'B':
+                open_spans[key] = e['ts']
+            elif e['ph'] == 'E' and key in open_spans:
+                matches.append(e['ts'] - open_spans.pop(key))
+        blocked = sum(1 for e in events if e['name'] == 'blocked')
+
+        report.update({
+            'windows': args.windows,
+            'subresources_per_page': PAGE_IMAGES + PAGE_SCRIPTS + PAGE_STYLES
+                                     + PAGE_ADS,
+            'adblock_patterns': len(ADBLOCK_PATTERNS),
+            'fifo_to_client_new_ms': percentiles(opened),
+            'client_new_to_load_finished_ms': percentiles(loads),
+            'adblock_match_us': percentiles(matches),
+            'adblock_blocked': blocked,
+            'rss_kb_before': rss_before,
+            'rss_kb_after': rss_after,
+            'rss_kb_per_client': (rss_after - rss_before) // max(len(clients), 1),
+        })
+    finally:
+        browser.terminate()
+        browser.wait()
+        if xvfb is not None:
+            xvfb.terminate()
+            xvfb.wait()
+        server.shutdown()
+        shutil.rmtree(tmp, ignore_errors=True)
+
+    out = json.dumps(report, indent=4, sort_keys=True) + '\n'
+    if args.output == '-':
+        sys.stdout.write(out)
+    else:
+        with open(args.output, 'w') as f:
+            f.write(out)
+
+
+if __name__ == '__main__':
+    main()
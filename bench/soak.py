@@ -0,0 +1,272 @@
+#!/usr/bin/env python3
+
+# Soak test. Runs lariza under Xvfb for thousands of cycles of opening and
+# closing windows, downloads, context menus and certificate reloads. The
+# UI process' allocation counters (dumped on SIGUSR2) and its RSS are
+# sampled along the way. The run fails if either keeps growing.
+
+import argparse
+import http.server
+import json
+import os
+import shutil
+import signal
+import socketserver
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+from bench import descendants, rss_kb
+
+
+DOWNLOAD_EVERY = 5
+DOWNLOAD_SIZE = 64 * 1024
+
+
+def page(n):
+    # A window that covers itself with a link (so right clicks open the
+    # context menu of a link), maybe starts a download and then closes.
+    # Scripts may close windows that have only seen a single page.
+    body = ['<!DOCTYPE html><html><head><title>Soak %d</title></head>' % n,
+            '<body style="margin: 0">',
+            '<a href="/page/%d" style="display: block; width: 100%%; '
+            'height: 100vh">Soak %d</a>' % (n, n),
+            '<script>']
+    if n % DOWNLOAD_EVERY == 0:
+        body.append('setTimeout(function() { location = "/file/%d"; }, 50);'
+                    % n)
+    body.append('setTimeout(function() { window.close(); }, 800);')
+    body.append('</script></body></html>')
+    return '\n'.join(body).encode()
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    def do_GET(self):
+        path = self.path.split('?')[0]
+        if path == '/anchor':
+            data = (b'<!DOCTYPE html><html><body style="margin: 0">'
+                    b'<a href="/anchor" style="display: block; width: 100%; '
+                    b'height: 100vh">Anchor</a></body></html>')
+            headers = [('Content-Type', 'text/html')]
+        elif path.startswith('/page/'):
+            data = page(int(path.split('/')[2]))
+            headers = [('Content-Type', 'text/html')]
+        elif path.startswith('/file/'):
+            data = os.urandom(DOWNLOAD_SIZE)
+            headers = [('Content-Type', 'application/octet-stream'),
+                       ('Content-Disposition',
+                        'attachment; filename="soak-%s.bin"'
+                        % path.split('/')[2])]
+        else:
+            self.send_error(404)
+            return
+        self.send_response(200)
+        for k, v in headers:
+            self.send_header(k, v)
+        self.send_header('Content-Length', str(len(data)))
+        self.send_header('Cache-Control', 'no-store')
+        self.end_headers()
+        self.wfile.write(data)
+
+    def log_message(self, *args):
+        pass
+
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+
+
+class AllocReader(threading.Thread):
+    # Collects the tables written by lariza on SIGUSR2 and passes
+    # everything else through to our stderr.
+    def __init__(self, stream):
+        super().__init__(daemon=True)
+        self.stream = stream
+        self.cond = threading.Condition()
+        self.tables = 0
+        self.table = {}
+        self.current = None
+
+    def run(self):
+        for line in self.stream:
+            line = line.decode(errors='replace')
+            if not line.startswith('lariza: alloc:'):
+                sys.stderr.write(line)
+                continue
+            fields = line.split()
+            if fields[2] == 'object':
+                self.finish()
+                self.current = {}
+            elif self.current is not None:
+                self.current[fields[2]] = int(fields[3])
+        self.finish()
+
+    def finish(self):
+        with self.cond:
+            if self.current is not None:
+                self.table = self.current
+                self.tables += 1
+                self.current = None
+                self.cond.notify_all()
+
+    def sample(self, pid, timeout=10):
+        # A table is complete once the next one starts, so ask twice. The
+        # first header completes the table left over from last time.
+        with self.cond:
+            want = self.tables + (2 if self.current is not None else 1)
+        os.kill(pid, signal.SIGUSR2)
+        time.sleep(0.2)
+        os.kill(pid, signal.SIGUSR2)
+        with self.cond:
+            self.cond.wait_for(lambda: self.tables >= want, timeout)
+            return dict(self.table)
+
+
+def xdotool(*args):
+    subprocess.call(['xdotool'] + list(args), stdout=subprocess.DEVNULL,
+                    stderr=subprocess.DEVNULL)
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument('--browser', default='./lariza')
+    ap.add_argument('--cycles', type=int, default=2000)
+    ap.add_argument('--burst', type=int, default=10)
+    ap.add_argument('--samples', type=int, default=20)
+    ap.add_argument('--rss-growth-kb', type=int, default=32 * 1024)
+    ap.add_argument('--timeout', type=float, default=60)
+    ap.add_argument('--output', default='-')
+    args = ap.parse_args()
+
+    tmp = tempfile.mkdtemp(prefix='lariza-soak-')
+    config = os.path.join(tmp, 'config', 'lariza')
+    certs = os.path.join(config, 'certs')
+    os.makedirs(certs)
+    if shutil.which('openssl'):
+        subprocess.call(['openssl', 'req', '-x509', '-newkey', 'rsa:2048',
+                         '-nodes', '-days', '1', '-subj', '/CN=127.0.0.1',
+                         '-keyout', os.path.join(tmp, 'key.pem'),
+                         '-out', os.path.join(certs, '127.0.0.1')],
+                        stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    downloads = os.path.join(tmp, 'downloads')
+    os.makedirs(downloads)
+    runtime = os.path.join(tmp, 'run')
+    os.makedirs(runtime, 0o700)
+
+    server = Server(('127.0.0.1', 0), Handler)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    base = 'http://127.0.0.1:%d' % server.server_address[1]
+
+    xvfb = None
+    env = dict(os.environ)
+    if 'DISPLAY' not in env:
+        display = ':%d' % (90 + os.getpid() % 100)
+        xvfb = subprocess.Popen(['Xvfb', display, '-screen', '0',
+                                 '1280x1024x24', '-nolisten', 'tcp'],
+                                stderr=subprocess.DEVNULL)
+        env['DISPLAY'] = display
+        time.sleep(1)
+    env.update({
+        'XDG_CONFIG_HOME': os.path.join(tmp, 'config'),
+        'XDG_CACHE_HOME': os.path.join(tmp, 'cache'),
+        'XDG_DATA_HOME': os.path.join(tmp, 'data'),
+        'XDG_RUNTIME_DIR': runtime,
+        'LARIZA_CACHE_EPHEMERAL': '1',
+        'LARIZA_DOWNLOAD_DIR': downloads,
+        'LARIZA_FIFO_SUFFIX': 'soak',
+    })
+    interactive = shutil.which('xdotool') is not None
+
+    fifo = os.path.join(runtime, 'lariza.fifo-soak')
+    browser = subprocess.Popen([args.browser, '-T', base + '/anchor'],
+                               env=env, stderr=subprocess.PIPE)
+    reader = AllocReader(browser.stderr)
+    reader.start()
+    report = {'cycles': args.cycles, 'interactive': interactive}
+    failures = []
+    try:
+        deadline = time.monotonic() + args.timeout
+        while not os.path.exists(fifo):
+            if time.monotonic() > deadline or browser.poll() is not None:
+                sys.exit('lariza did not start')
+            time.sleep(0.1)
+        time.sleep(1)
+
+        samples = []
+        every = max(args.cycles // args.samples, args.burst)
+        n = 0
+        with open(fifo, 'w') as f:
+            while n < args.cycles:
+                for i in range(min(args.burst, args.cycles - n)):
+                    f.write('%s/page/%d\n' % (base, n + i))
+                f.flush()
+                n += args.burst
+
+                if interactive:
+                    xdotool('mousemove', '400', '300', 'click', '3')
+                    time.sleep(0.1)
+                    xdotool('key', 'Escape')
+                    xdotool('key', 'alt+c')
+
+                # Wait for the windows to close themselves. Only the
+                # anchor window is left then.
+                deadline = time.monotonic() + args.timeout
+                while True:
+                    alloc = reader.sample(browser.pid)
+                    if alloc.get('client') == 1:
+                        break
+                    if browser.poll() is not None:
+                        sys.exit('lariza died')
+                    if time.monotonic() > deadline:
+                        sys.exit('windows did not close: %r' % alloc)
+                    time.sleep(0.5)
+
+                if n % every < args.burst:
+                    samples.append({'cycle': n, 'alloc': alloc,
+                                    'rss_kb': rss_kb([browser.pid])})
+
+        # Allocations must level off in the first half of the run and
+        # stay there. The same goes for RSS, with some slack for heap
+        # fragmentation.
+        half = samples[:len(samples) // 2] or samples[:1]
+        last = samples[-1]
+        for name, live in last['alloc'].items():
+            plateau = max(s['alloc'].get(name, 0) for s in half)
+            if live > plateau:
+                failures.append('%s: %d live, at most %d before'
+                                % (name, live, plateau))
+        rss_plateau = max(s['rss_kb'] for s in half)
+        if last['rss_kb'] > rss_plateau + args.rss_growth_kb:
+            failures.append('RSS grew from %d KiB to %d KiB'
+                            % (rss_plateau, last['rss_kb']))
+
+        report.update({
+            'samples': samples,
+            'failures': failures,
+            'rss_kb_web_processes': rss_kb(descendants(browser.pid)[1:]),
+        })
+    finally:
+        browser.terminate()
+        browser.wait()
+        if xvfb is not None:
+            xvfb.terminate()
+            xvfb.wait()
+        server.shutdown()
+        shutil.rmtree(tmp, ignore_errors=True)
+
+    out = json.dumps(report, indent=4, sort_keys=True) + '\n'
+    if args.output == '-':
+        sys.stdout.write(out)
+    else:
+        with open(args.output, 'w') as f:
+            f.write(out)
+
+    for msg in failures:
+        print('soak: ' + msg, file=sys.stderr)
+    sys.exit(1 if failures else 0)
+
+
+if __name__ == '__main__':
+    main()
@@ -1,4 +1,5 @@
 #include <limits.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -10,55 +11,280 @@
 #include <gtk/gtkx.h>
 #include <gdk/gdkkeysyms.h>
 #include <gio/gio.h>
+#include <glib-unix.h>
 #include <webkit2/webkit2.h>
 
-
+#include "adblock.h"
+#include "trace.h"
+
+
+static void alloc_count(guint, gint);
+static void alloc_dump(void);
+static gboolean alloc_signal(gpointer);
+static gboolean background_focus(GtkWidget *, GdkEvent *, gpointer);
+static gboolean background_next(gpointer);
+static void background_schedule(void);
+static void background_start(gpointer);
+static void batch_add(const gchar *);
+static void batch_capture(gpointer);
+static gboolean batch_check_done(gpointer);
+static gboolean batch_decide_policy(WebKitWebView *, WebKitPolicyDecision *,
+                                    WebKitPolicyDecisionType, gpointer);
+static void batch_done(gpointer, const gchar *);
+static gboolean batch_failed(WebKitWebView *, WebKitLoadEvent, gchar *, GError *,
+                             gpointer);
+static void batch_load_changed(WebKitWebView *, WebKitLoadEvent, gpointer);
+static void batch_print_failed(WebKitPrintOperation *, GError *, gpointer);
+static void batch_print_finished(WebKitPrintOperation *, gpointer);
+static void batch_pump(void);
+static void batch_reject(gpointer);
+static gboolean batch_rejected(gpointer);
+static void batch_snapshot_done(GObject *, GAsyncResult *, gpointer);
+static gboolean batch_stdin(GIOChannel *, GIOCondition, gpointer);
+static gboolean batch_timed_out(gpointer);
+static void cache_clear_done(GObject *, GAsyncResult *, gpointer);
+static gint cache_size_cmp(gconstpointer, gconstpointer);
+static void cache_stats_fetched(GObject *, GAsyncResult *, gpointer);
+static gboolean cache_trim(gpointer);
+static void cache_trim_fetched(GObject *, GAsyncResult *, gpointer);
+static void client_connect_web_view(gpointer);
 static void client_destroy(GtkWidget *, gpointer);
 static gboolean client_destroy_request(WebKitWebView *, gpointer);
-static WebKitWebView *client_new(const gchar *, WebKitWebView *, gboolean);
+static WebKitWebView *client_new(const gchar *, WebKitWebView *, gboolean,
+                                 gboolean);
 static WebKitWebView *client_new_request(WebKitWebView *, WebKitNavigationAction *,
                                          gpointer);
+static WebKitWebView *client_related_view(const gchar *);
+static WebKitWebView *client_same_site(const gchar *);
+static gboolean command_run(gpointer, const gchar *);
 static void cooperation_setup(void);
 static void changed_download_progress(GObject *, GParamSpec *, gpointer);
 static void changed_load_progress(GObject *, GParamSpec *, gpointer);
+static void changed_load_state(WebKitWebView *, WebKitLoadEvent, gpointer);
 static void changed_title(GObject *, GParamSpec *, gpointer);
 static void changed_uri(GObject *, GParamSpec *, gpointer);
+static gboolean crash_recover(gpointer);
 static gboolean crashed_web_view(WebKitWebView *, gpointer);
 static gboolean decide_policy(WebKitWebView *, WebKitPolicyDecision *,
                               WebKitPolicyDecisionType, gpointer);
 static gboolean download_handle(WebKitDownload *, gchar *, gpointer);
 static void download_handle_start(WebKitWebView *, WebKitDownload *, gpointer);
+static void download_hash_done(GObject *, GAsyncResult *, gpointer);
+static void download_hash_failed(WebKitDownload *, GError *, gpointer);
+static void download_hash_finished(WebKitDownload *, gpointer);
+static void download_hash_free(gpointer);
+static void download_hash_progress(GObject *, GParamSpec *, gpointer);
+static void download_hash_run(gpointer);
+static void download_hash_thread(GTask *, gpointer, gpointer, GCancellable *);
 static void downloadmanager_cancel(GtkToolButton *, gpointer data);
 static gboolean downloadmanager_delete(GtkWidget *, gpointer);
+static void downloadmanager_item_free(gpointer);
 static void downloadmanager_setup(void);
+static void downloadmanager_trim(void);
 static gchar *ensure_uri_scheme(const gchar *);
 static void external_handler_run(GtkAction *, gpointer);
+static void frame_after_paint(GdkFrameClock *, gpointer);
+static void frame_realize(GtkWidget *, gpointer);
+static void frame_unrealize(GtkWidget *, gpointer);
 static void grab_environment_configuration(void);
 static void hover_web_view(WebKitWebView *, WebKitHitTestResult *, guint, gpointer);
 static gboolean key_common(GtkWidget *, GdkEvent *, gpointer);
 static gboolean key_downloadmanager(GtkWidget *, GdkEvent *, gpointer);
 static gboolean key_location(GtkWidget *, GdkEvent *, gpointer);
 static gboolean key_web_view(GtkWidget *, GdkEvent *, gpointer);
+static gchar *keywords_expand(const gchar *);
 static void keywords_load(void);
 static gboolean keywords_try_search(WebKitWebView *, const gchar *);
+static gboolean load_blocked(WebKitWebView *);
+static gboolean load_focus(GtkWidget *, GdkEvent *, gpointer);
+static gboolean load_next(gpointer);
+static void load_release(gpointer);
+static void load_request(gpointer, const gchar *);
+static gboolean load_stalled(gpointer);
+static void load_start(gpointer);
+static gint memory_cmp(gconstpointer, gconstpointer);
+static void memory_dump(void);
+static gboolean memory_sample(gpointer);
+static void memory_sample_thread(GTask *, gpointer, gpointer, GCancellable *);
+static void memory_sampled(GObject *, GAsyncResult *, gpointer);
 static gboolean menu_web_view(WebKitWebView *, WebKitContextMenu *, GdkEvent *,
                               WebKitHitTestResult *, gpointer);
+static struct Client *metrics_client(guint64);
+static gboolean metrics_msg(GIOChannel *, GIOCondition, gpointer);
+static void metrics_setup(void);
+static void metrics_write(gpointer);
+static gboolean pagecache_check(gpointer);
+static void pagecache_evict(void);
+static gboolean pagecache_failed(WebKitWebView *, WebKitLoadEvent, gchar *,
+                                 GError *, gpointer);
+static void pagecache_go(gpointer, gint);
+static void pagecache_reset(gpointer);
+static void pagecache_resource(WebKitWebView *, WebKitWebResource *,
+                               WebKitURIRequest *, gpointer);
+static gboolean prefetch_dwell(gpointer);
+static void prefetch_schedule(gpointer);
+static void prefetch_uri(WebKitWebContext *, const gchar *);
+static void preload_changed(GtkEditable *, gpointer);
+static void preload_discard(gpointer);
+static void preload_load_changed(WebKitWebView *, WebKitLoadEvent, gpointer);
+static gboolean preload_policy(WebKitWebView *, WebKitPolicyDecision *,
+                               WebKitPolicyDecisionType, gpointer);
+static gchar *preload_resolve(const gchar *);
+static gboolean preload_swap(gpointer, const gchar *);
+static gboolean preload_typed(gpointer);
+static void profiles_apply(gpointer, const gchar *);
+static void profiles_load(void);
 static gboolean quit_if_nothing_active(void);
 static gboolean remote_msg(GIOChannel *, GIOCondition, gpointer);
 static void search(gpointer, gint);
+static void search_changed(GtkEditable *, gpointer);
+static void search_counted(WebKitFindController *, guint, gpointer);
+static gboolean search_debounced(gpointer);
+static void search_failed(WebKitFindController *, gpointer);
+static void search_status(gpointer);
+static WebKitSettings *settings_new(void);
+static void settings_setup(WebKitSettings *);
 static void show_web_view(WebKitWebView *, gpointer);
 static Window tabbed_launch(void);
 static void trust_user_certs(WebKitWebContext *);
+static void ui_queue_location(gpointer, const gchar *);
+static void ui_queue_progress(gpointer, gdouble);
+static void ui_queue_title(gpointer, const gchar *);
+static void ui_schedule(gpointer);
+static gboolean ui_update(GtkWidget *, GdkFrameClock *, gpointer);
+static void uri_cache_entry_free(gpointer);
+static gchar *uri_classify_lexical(const gchar *);
+static gchar *uri_host(const gchar *);
+static void uri_load(WebKitWebView *, const gchar *);
+static void uri_probe_deliver(gpointer, const gchar *);
+static void uri_probe_done(GObject *, GAsyncResult *, gpointer);
+static void uri_probe_release(gpointer);
+static void uri_probe_thread(GTask *, gpointer, gpointer, GCancellable *);
+static gboolean uri_probe_timeout(gpointer);
+static gulong watchdog_connect(gpointer, const gchar *, GCallback, gpointer,
+                               const gchar *);
+static void watchdog_dump(void);
+static void watchdog_enter(gpointer, GClosure *);
+static void watchdog_leave(gpointer, GClosure *);
+static void watchdog_record(const gchar *, gint64);
+static gboolean watchdog_tick(gpointer);
+static void web_context_setup(void);
+
+/* Like g_signal_connect(), but lets the watchdog time the handler. */
+#define watched_signal_connect(instance, signal, cb, data) \
+    watchdog_connect((instance), (signal), G_CALLBACK(cb), (data), #cb)
+
+/* Objects whose allocations are counted, see alloc_count(). */
+enum
+{
+    ALLOC_BATCH_JOB,
+    ALLOC_CLIENT,
+    ALLOC_DOWNLOAD,
+    ALLOC_DOWNLOAD_HASH,
+    ALLOC_URI_PROBE,
+
+    ALLOC_LAST,
+};
 
 
+struct AllocStats
+{
+    const gchar *name;
+    guint live;
+    guint total;
+};
+
 struct Client
 {
+    gchar *background_uri;
+    gint64 crash_at;
+    gint64 crash_counted_at;
+    gboolean crash_reloading;
+    guint crash_timer;
+    GtkAction *external_handler_action;
     gchar *external_handler_uri;
+    guint frame_count;
+    gint64 frame_last;
+    gint64 frame_max_us;
+    guint frame_slow;
+    gint64 frame_total_us;
     gchar *hover_uri;
+    gchar *load_queued;
+    gboolean load_slot;
+    guint load_timer;
     GtkWidget *location;
+    gint memory_pid;
+    guint64 memory_pss_kb;
+    guint64 memory_rss_kb;
+    guint metrics_blocked;
+    gint64 metrics_match_us;
+    guint metrics_requests;
+    gchar *metrics_uri;
+    gboolean pagecache_miss;
+    gboolean pagecache_pending;
+    guint pagecache_timer;
+    guint prefetch_timer;
+    guint preload_timer;
+    gchar *preload_uri;
+    GtkWidget *preload_view;
+    guint process_group;
+    gchar *profile_host;
+    guint search_count;
+    guint search_index;
+    GtkWidget *search_label;
+    guint search_limit;
+    guint search_timer;
     GtkWidget *vbox;
     GtkWidget *web_view;
     GtkWidget *win;
+
+    /* Latest values reported by WebKit that have not yet been pushed
+     * into the widgets. They are applied once per frame. */
+    gchar *ui_location;
+    gdouble ui_progress;
+    gchar *ui_title;
+    guint ui_tick;
+};
+
+struct BatchJob
+{
+    gboolean failed;
+    guint id;
+    gchar *path;
+    gint64 queued, started, loaded;
+    guint timeout;
+    gboolean timed_out;
+    gchar *uri;
+    GtkWidget *web_view;
+    GtkWidget *win;
+};
+
+struct CrashHost
+{
+    guint count;
+    gint64 since;
+};
+
+struct WatchdogStats
+{
+    guint count;
+    guint histogram[12];
+    gint64 max_us;
+    gint64 total_us;
+};
+
+struct DownloadHash
+{
+    gboolean busy;
+    GChecksum *checksum;
+    WebKitDownload *download;
+    gboolean failed;
+    gboolean final;
+    gboolean finished;
+    int fd;
+    goffset hashed;
+    gchar *path;
+    GtkToolItem *tb;
 };
 
 struct DownloadManager
@@ -68,610 +294,2179 @@ struct DownloadManager
     GtkWidget *win;
 } dm;
 
+struct MemorySample
+{
+    gint pid;
+    guint64 pss_kb;
+    guint64 rss_kb;
+};
+
+struct RenderingProfile
+{
+    const gchar *name;
+    WebKitHardwareAccelerationPolicy policy;
+    gboolean smooth_scrolling;
+    gboolean accelerated_2d_canvas;
+};
+
+struct ProfileRule
+{
+    GPatternSpec *pattern;
+    GParamSpec *pspec;
+    GValue value;
+};
+
+struct UriCacheEntry
+{
+    gchar *uri;
+    gint64 expires;
+};
+
+struct UriProbe
+{
+    gboolean delivered;
+    gchar *input;
+    gint refs;
+    guint timeout;
+    WebKitWebView *web_view;
+};
+
 
 static const gchar *accepted_language[2] = { NULL, NULL };
+static struct AllocStats alloc_stats[ALLOC_LAST] = {
+    [ALLOC_BATCH_JOB] = { "batch_job" },
+    [ALLOC_CLIENT] = { "client" },
+    [ALLOC_DOWNLOAD] = { "download" },
+    [ALLOC_DOWNLOAD_HASH] = { "download_hash" },
+    [ALLOC_URI_PROBE] = { "uri_probe" },
+};
+static guint background_idle = 0;
+static gboolean background_open = FALSE;
+static gchar *batch_dir = NULL;
+static gboolean batch_input_open = FALSE;
+static guint batch_jobs = 4;
+static guint batch_next_id = 0;
+static gboolean batch_pdf = FALSE;
+static GQueue batch_queue = G_QUEUE_INIT;
+static guint batch_running = 0;
+static gboolean batch_serve = FALSE;
+static const gint batch_width = 1280, batch_height = 1024;
+static guint batch_timeout = 30;
+static gchar *cache_dir = NULL;
+static gboolean cache_ephemeral = FALSE;
+static WebKitCacheModel cache_model = WEBKIT_CACHE_MODEL_WEB_BROWSER;
+static guint64 cache_size_max = 0;
+static const guint cache_trim_interval = 300;
+static GList *client_list = NULL;
 static gint clients = 0, downloads = 0;
 static gboolean cooperative_alone = TRUE;
 static gboolean cooperative_instances = TRUE;
 static int cooperative_pipe_fp = 0;
+static const guint crash_backoff_ms = 500;
+static const guint crash_backoff_max_ms = 30000;
+static const gint64 crash_coalesce = G_USEC_PER_SEC;
+static guint crash_count = 0;
+static GHashTable *crash_hosts = NULL;
+static guint crash_recovered = 0;
+static gint64 crash_recovery_max_us = 0;
+static gint64 crash_recovery_total_us = 0;
+static guint crash_retries = 3;
+static const gint64 crash_window = 120 * G_USEC_PER_SEC;
 static gchar *download_dir = "/var/tmp";
+static gboolean download_sidecar = FALSE;
+static const guint downloadmanager_keep = 50;
 static gboolean enable_webgl = FALSE;
 static Window embed = 0;
 static gchar *fifo_suffix = "main";
+static gboolean frame_stats = FALSE;
 static gdouble global_zoom = 1.0;
 static gchar *history_file = NULL;
 static gchar *home_uri = "about:blank";
 static gboolean initial_wc_setup_done = FALSE;
 static GHashTable *keywords = NULL;
+static guint load_active = 0;
+static guint load_idle = 0;
+static guint load_limit = 4;
+static const guint load_stall_timeout = 10;
+static guint memory_interval = 10;
+static gboolean memory_sampling = FALSE;
+static struct MemorySample memory_ui = { 0 };
+static gchar *metrics_fifo = NULL;
+static gchar *metrics_file = NULL;
+static guint64 pagecache_baseline_kb = 0;
+static guint pagecache_baseline_processes = 0;
+static guint64 pagecache_budget_kb = 0;
+static guint pagecache_evictions = 0;
+static guint pagecache_hits = 0;
+static guint pagecache_misses = 0;
+static gboolean prefetch_enabled = FALSE;
+static const guint prefetch_dwell_ms = 150;
+static GHashTable *prefetch_hosts = NULL;
+static const guint prefetch_hosts_max = 256;
+static const gint64 prefetch_host_ttl = 60 * G_USEC_PER_SEC;
+static guint prefetch_rate = 0;
+static const guint prefetch_rate_max = 8;
+static gint64 prefetch_rate_since = 0;
+static const guint preload_debounce_ms = 300;
+static gboolean preload_dns = FALSE;
+static gboolean preload_prerender = FALSE;
+static guint process_group_next = 0;
+static guint process_limit = 0;
+static gboolean process_per_site = FALSE;
+static gboolean process_shared = FALSE;
+static WebKitSettings *profile_defaults = NULL;
+static GSList *profile_rules = NULL;
+static struct RenderingProfile *rendering_profile = NULL;
+static struct RenderingProfile rendering_profiles[] = {
+    { "accelerated", WEBKIT_HARDWARE_ACCELERATION_POLICY_ALWAYS, TRUE, TRUE },
+    { "balanced", WEBKIT_HARDWARE_ACCELERATION_POLICY_ON_DEMAND, TRUE, FALSE },
+    { "software-lean", WEBKIT_HARDWARE_ACCELERATION_POLICY_NEVER, FALSE, FALSE },
+};
+static const guint search_debounce_ms = 150;
+static const guint search_limit_initial = 100;
 static gchar *search_text = NULL;
 static gboolean tabbed_automagic = TRUE;
+static gchar *trace_file = NULL;
+static GHashTable *uri_cache = NULL;
+static const guint uri_cache_max = 64;
+static const gint64 uri_cache_ttl = 60 * G_USEC_PER_SEC;
+static const guint uri_probe_timeout_ms = 500;
 static gchar *user_agent = NULL;
+static guint watchdog_depth = 0;
+static gint64 watchdog_last_tick = 0;
+static gint64 watchdog_started[16];
+static GHashTable *watchdog_stats = NULL;
+static gint64 watchdog_threshold_us = 0;
+static const guint watchdog_tick_ms = 50;
+static WebKitWebContext *web_context = NULL;
 
 
 void
-client_destroy(GtkWidget *widget, gpointer data)
+alloc_count(guint what, gint delta)
 {
-    struct Client *c = (struct Client *)data;
-
-    g_signal_handlers_disconnect_by_func(G_OBJECT(c->web_view),
-                                         changed_load_progress, c);
+    alloc_stats[what].live += delta;
+    if (delta > 0)
+        alloc_stats[what].total += delta;
+}
 
-    free(c);
-    clients--;
+void
+alloc_dump(void)
+{
+    guint i;
 
-    quit_if_nothing_active();
+    fprintf(stderr, __NAME__": alloc: %-14s %10s %10s\n", "object", "live",
+            "total");
+    for (i = 0; i < ALLOC_LAST; i++)
+        fprintf(stderr, __NAME__": alloc: %-14s %10u %10u\n",
+                alloc_stats[i].name, alloc_stats[i].live, alloc_stats[i].total);
 }
 
 gboolean
-client_destroy_request(WebKitWebView *web_view, gpointer data)
+alloc_signal(gpointer data)
 {
-    struct Client *c = (struct Client *)data;
-
-    gtk_widget_destroy(c->win);
+    alloc_dump();
+    return G_SOURCE_CONTINUE;
+}
 
-    return TRUE;
+gboolean
+background_focus(GtkWidget *widget, GdkEvent *event, gpointer data)
+{
+    background_start(data);
+    return FALSE;
 }
 
-WebKitWebView *
-client_new(const gchar *uri, WebKitWebView *related_wv, gboolean show)
+gboolean
+background_next(gpointer data)
 {
     struct Client *c;
-    WebKitWebContext *wc;
-    gchar *f;
+    GList *it;
 
-    if (uri != NULL && cooperative_instances && !cooperative_alone)
-    {
-        f = ensure_uri_scheme(uri);
-        write(cooperative_pipe_fp, f, strlen(f));
-        write(cooperative_pipe_fp, "\n", 1);
-        g_free(f);
-        return NULL;
-    }
+    background_idle = 0;
 
-    c = calloc(1, sizeof(struct Client));
-    if (!c)
+    /* Background windows only load while nothing else does. */
+    for (it = client_list; it != NULL; it = g_list_next(it))
     {
-        fprintf(stderr, __NAME__": fatal: calloc failed\n");
-        exit(EXIT_FAILURE);
+        c = (struct Client *)it->data;
+        if (webkit_web_view_is_loading(WEBKIT_WEB_VIEW(c->web_view)) ||
+            c->load_queued != NULL)
+            return G_SOURCE_REMOVE;
     }
 
-    if (embed != 0)
+    /* New clients are prepended, so start with the oldest. */
+    for (it = g_list_last(client_list); it != NULL; it = g_list_previous(it))
     {
-        c->win = gtk_plug_new(embed);
-        if (!gtk_plug_get_embedded(GTK_PLUG(c->win)))
+        c = (struct Client *)it->data;
+        if (c->background_uri != NULL)
         {
-            fprintf(stderr, __NAME__": Can't plug-in to XID %ld.\n", embed);
-            gtk_widget_destroy(c->win);
-            c->win = NULL;
-            embed = 0;
+            background_start(c);
+            break;
         }
     }
 
-    if (c->win == NULL)
-        c->win = gtk_window_new(GTK_WINDOW_TOPLEVEL);
-
-    gtk_window_set_default_size(GTK_WINDOW(c->win), 800, 600);
-
-    g_signal_connect(G_OBJECT(c->win), "destroy", G_CALLBACK(client_destroy), c);
-    gtk_window_set_title(GTK_WINDOW(c->win), __NAME__);
+    return G_SOURCE_REMOVE;
+}
 
-    if (related_wv == NULL)
-        c->web_view = webkit_web_view_new();
-    else
-        c->web_view = webkit_web_view_new_with_related_view(related_wv);
-    wc = webkit_web_view_get_context(WEBKIT_WEB_VIEW(c->web_view));
+void
+background_schedule(void)
+{
+    if (background_idle == 0)
+        background_idle = g_idle_add(background_next, NULL);
+}
 
-    webkit_web_view_set_zoom_level(WEBKIT_WEB_VIEW(c->web_view), global_zoom);
-    g_signal_connect(G_OBJECT(c->web_view), "notify::title",
-                     G_CALLBACK(changed_title), c);
-    g_signal_connect(G_OBJECT(c->web_view), "notify::uri",
-                     G_CALLBACK(changed_uri), c);
-    g_signal_connect(G_OBJECT(c->web_view), "notify::estimated-load-progress",
-                     G_CALLBACK(changed_load_progress), c);
-    g_signal_connect(G_OBJECT(c->web_view), "create",
-                     G_CALLBACK(client_new_request), NULL);
-    g_signal_connect(G_OBJECT(c->web_view), "context-menu",
-                     G_CALLBACK(menu_web_view), c);
-    g_signal_connect(G_OBJECT(c->web_view), "close",
-                     G_CALLBACK(client_destroy_request), c);
-    g_signal_connect(G_OBJECT(c->web_view), "decide-policy",
-                     G_CALLBACK(decide_policy), NULL);
-    g_signal_connect(G_OBJECT(c->web_view), "key-press-event",
-                     G_CALLBACK(key_web_view), c);
-    g_signal_connect(G_OBJECT(c->web_view), "button-press-event",
-                     G_CALLBACK(key_web_view), c);
-    g_signal_connect(G_OBJECT(c->web_view), "scroll-event",
-                     G_CALLBACK(key_web_view), c);
-    g_signal_connect(G_OBJECT(c->web_view), "mouse-target-changed",
-                     G_CALLBACK(hover_web_view), c);
-    g_signal_connect(G_OBJECT(c->web_view), "web-process-crashed",
-                     G_CALLBACK(crashed_web_view), c);
+void
+background_start(gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+    gchar *uri;
 
-    if (!initial_wc_setup_done)
-    {
-        if (accepted_language[0] != NULL)
-            webkit_web_context_set_preferred_languages(wc, accepted_language);
+    if (c->background_uri == NULL)
+        return;
 
-        g_signal_connect(G_OBJECT(wc), "download-started",
-                         G_CALLBACK(download_handle_start), NULL);
+    g_signal_handlers_disconnect_by_func(G_OBJECT(c->win), background_focus, c);
 
-        trust_user_certs(wc);
+    uri = c->background_uri;
+    c->background_uri = NULL;
+    load_request(c, uri);
+    g_free(uri);
+}
 
-        initial_wc_setup_done = TRUE;
-    }
+void
+batch_add(const gchar *uri)
+{
+    struct BatchJob *j;
 
-    if (user_agent != NULL)
-        g_object_set(G_OBJECT(webkit_web_view_get_settings(WEBKIT_WEB_VIEW(c->web_view))),
-                     "user-agent", user_agent, NULL);
+    j = g_new0(struct BatchJob, 1);
+    alloc_count(ALLOC_BATCH_JOB, 1);
+    j->id = batch_next_id++;
+    j->uri = ensure_uri_scheme(uri);
+    j->queued = g_get_monotonic_time();
+    g_queue_push_tail(&batch_queue, j);
 
-    if (enable_webgl)
-        webkit_settings_set_enable_webgl(webkit_web_view_get_settings(WEBKIT_WEB_VIEW(c->web_view)), TRUE);
+    batch_pump();
+}
 
-    c->location = gtk_entry_new();
-    g_signal_connect(G_OBJECT(c->location), "key-press-event",
-                     G_CALLBACK(key_location), c);
+void
+batch_capture(gpointer data)
+{
+    struct BatchJob *j = (struct BatchJob *)data;
+    WebKitPrintOperation *op;
+    GtkPrintSettings *ps;
+    gchar *name, *uri;
 
-    c->vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
-    gtk_box_pack_start(GTK_BOX(c->vbox), c->location, FALSE, FALSE, 0);
-    gtk_box_pack_start(GTK_BOX(c->vbox), c->web_view, TRUE, TRUE, 0);
+    /* Whatever the page does from now on, e.g. a meta refresh, must not
+     * trigger another capture. */
+    g_signal_handlers_disconnect_by_data(G_OBJECT(j->web_view), j);
 
-    gtk_container_add(GTK_CONTAINER(c->win), c->vbox);
+    j->loaded = g_get_monotonic_time();
 
-    if (show)
-        show_web_view(NULL, c);
-    else
-        g_signal_connect(G_OBJECT(c->web_view), "ready-to-show",
-                         G_CALLBACK(show_web_view), c);
+    name = g_strdup_printf("%06u.%s", j->id, batch_pdf ? "pdf" : "png");
+    j->path = g_build_filename(batch_dir, name, NULL);
+    g_free(name);
 
-    if (uri != NULL)
+    if (batch_pdf)
     {
-        f = ensure_uri_scheme(uri);
-        webkit_web_view_load_uri(WEBKIT_WEB_VIEW(c->web_view), f);
-        g_free(f);
-    }
-
-    clients++;
+        uri = g_filename_to_uri(j->path, NULL, NULL);
+        ps = gtk_print_settings_new();
+        gtk_print_settings_set_printer(ps, "Print to File");
+        gtk_print_settings_set(ps, GTK_PRINT_SETTINGS_OUTPUT_FILE_FORMAT, "pdf");
+        gtk_print_settings_set(ps, GTK_PRINT_SETTINGS_OUTPUT_URI, uri);
+        g_free(uri);
 
-    return WEBKIT_WEB_VIEW(c->web_view);
+        op = webkit_print_operation_new(WEBKIT_WEB_VIEW(j->web_view));
+        webkit_print_operation_set_print_settings(op, ps);
+        g_object_unref(ps);
+        watched_signal_connect(G_OBJECT(op), "finished",
+                               batch_print_finished, j);
+        watched_signal_connect(G_OBJECT(op), "failed",
+                               batch_print_failed, j);
+        webkit_print_operation_print(op);
+    }
+    else
+        webkit_web_view_get_snapshot(WEBKIT_WEB_VIEW(j->web_view),
+                                     WEBKIT_SNAPSHOT_REGION_FULL_DOCUMENT,
+                                     WEBKIT_SNAPSHOT_OPTIONS_NONE, NULL,
+                                     batch_snapshot_done, j);
 }
 
-WebKitWebView *
-client_new_request(WebKitWebView *web_view,
-                   WebKitNavigationAction *navigation_action, gpointer data)
+gboolean
+batch_check_done(gpointer data)
 {
-    return client_new(NULL, web_view, FALSE);
+    if (batch_running == 0 && g_queue_is_empty(&batch_queue) &&
+        !batch_input_open && !batch_serve)
+        gtk_main_quit();
+
+    return G_SOURCE_REMOVE;
 }
 
 void
-cooperation_setup(void)
+batch_done(gpointer data, const gchar *status)
 {
-    GIOChannel *towatch;
-    gchar *fifofilename, *fifopath;
+    struct BatchJob *j = (struct BatchJob *)data;
+    gint64 now = g_get_monotonic_time();
+
+    if (j->loaded == 0)
+        j->loaded = now;
+
+    /* One line per job: status, time spent waiting in the queue,
+     * loading and capturing (all in milliseconds), output file, URI. */
+    printf("%s\t%.1f\t%.1f\t%.1f\t%s\t%s\n", status,
+           (j->started - j->queued) / 1e3, (j->loaded - j->started) / 1e3,
+           (now - j->loaded) / 1e3, j->path == NULL ? "-" : j->path, j->uri);
+    fflush(stdout);
+
+    if (j->timeout != 0)
+        g_source_remove(j->timeout);
+    gtk_widget_destroy(j->win);
+    g_free(j->path);
+    g_free(j->uri);
+    g_free(j);
+    alloc_count(ALLOC_BATCH_JOB, -1);
+
+    batch_running--;
+    batch_pump();
+    batch_check_done(NULL);
+}
 
-    fifofilename = g_strdup_printf("%s-%s", __NAME__".fifo", fifo_suffix);
-    fifopath = g_build_filename(g_get_user_runtime_dir(), fifofilename, NULL);
-    g_free(fifofilename);
+gboolean
+batch_decide_policy(WebKitWebView *web_view, WebKitPolicyDecision *decision,
+                    WebKitPolicyDecisionType type, gpointer data)
+{
+    /* Nothing to render, e.g. an attachment. */
+    if (type != WEBKIT_POLICY_DECISION_TYPE_RESPONSE ||
+        webkit_response_policy_decision_is_mime_type_supported(
+            WEBKIT_RESPONSE_POLICY_DECISION(decision)))
+        return FALSE;
+
+    webkit_policy_decision_ignore(decision);
+    batch_reject(data);
+    return TRUE;
+}
 
-    if (!g_file_test(fifopath, G_FILE_TEST_EXISTS))
-        mkfifo(fifopath, 0600);
+gboolean
+batch_failed(WebKitWebView *web_view, WebKitLoadEvent load_event,
+             gchar *failing_uri, GError *error, gpointer data)
+{
+    struct BatchJob *j = (struct BatchJob *)data;
 
-    cooperative_pipe_fp = open(fifopath, O_WRONLY | O_NONBLOCK);
-    if (!cooperative_pipe_fp)
-    {
-        fprintf(stderr, __NAME__": Can't open FIFO at all.\n");
-    }
-    else
-    {
-        if (write(cooperative_pipe_fp, "", 0) == -1)
-        {
-            /* Could not do an empty write to the FIFO which means there's
-             * no one listening. */
-            close(cooperative_pipe_fp);
-            towatch = g_io_channel_new_file(fifopath, "r+", NULL);
-            g_io_add_watch(towatch, G_IO_IN, (GIOFunc)remote_msg, NULL);
-        }
-        else
-            cooperative_alone = FALSE;
-    }
+    /* load-changed will still report WEBKIT_LOAD_FINISHED. Errors
+     * caused by us stopping the load after a timeout don't count. */
+    if (!j->timed_out)
+        j->failed = TRUE;
 
-    g_free(fifopath);
+    return FALSE;
 }
 
 void
-changed_download_progress(GObject *obj, GParamSpec *pspec, gpointer data)
+batch_load_changed(WebKitWebView *web_view, WebKitLoadEvent load_event,
+                   gpointer data)
 {
-    WebKitDownload *download = WEBKIT_DOWNLOAD(obj);
-    WebKitURIResponse *resp;
-    GtkToolItem *tb = GTK_TOOL_ITEM(data);
-    gdouble p, size_mb;
-    const gchar *uri;
-    gchar *t, *filename, *base;
-
-    p = webkit_download_get_estimated_progress(download);
-    p = p > 1 ? 1 : p;
-    p = p < 0 ? 0 : p;
-    p *= 100;
-    resp = webkit_download_get_response(download);
-    size_mb = webkit_uri_response_get_content_length(resp) / 1e6;
+    struct BatchJob *j = (struct BatchJob *)data;
 
-    uri = webkit_download_get_destination(download);
-    filename = g_filename_from_uri(uri, NULL, NULL);
-    if (filename == NULL)
+    if ((load_event == WEBKIT_LOAD_STARTED ||
+         load_event == WEBKIT_LOAD_REDIRECTED) && load_blocked(web_view))
     {
-        /* This really should not happen because WebKit uses that URI to
-         * write to a file... */
-        fprintf(stderr, __NAME__": Could not construct file name from URI!\n");
-        t = g_strdup_printf("%s (%.0f%% of %.1f MB)",
-                            webkit_uri_response_get_uri(resp), p, size_mb);
+        batch_reject(j);
+        return;
     }
-    else
+
+    if (load_event != WEBKIT_LOAD_FINISHED || j->timed_out)
+        return;
+
+    if (j->timeout != 0)
     {
-        base = g_path_get_basename(filename);
-        t = g_strdup_printf("%s (%.0f%% of %.1f MB)", base, p, size_mb);
-        g_free(filename);
-        g_free(base);
+        g_source_remove(j->timeout);
+        j->timeout = 0;
     }
-    gtk_tool_button_set_label(GTK_TOOL_BUTTON(tb), t);
-    g_free(t);
+
+    if (j->failed)
+        batch_done(j, "failed");
+    else
+        batch_capture(j);
 }
 
 void
-changed_load_progress(GObject *obj, GParamSpec *pspec, gpointer data)
+batch_print_failed(WebKitPrintOperation *op, GError *err, gpointer data)
 {
-    struct Client *c = (struct Client *)data;
-    gdouble p;
+    struct BatchJob *j = (struct BatchJob *)data;
 
-    p = webkit_web_view_get_estimated_load_progress(WEBKIT_WEB_VIEW(c->web_view));
-    if (p == 1)
-        p = 0;
-    gtk_entry_set_progress_fraction(GTK_ENTRY(c->location), p);
+    fprintf(stderr, __NAME__": Could not print '%s': %s\n", j->uri,
+            err->message);
+    j->failed = TRUE;
 }
 
 void
-changed_title(GObject *obj, GParamSpec *pspec, gpointer data)
+batch_print_finished(WebKitPrintOperation *op, gpointer data)
 {
-    const gchar *t, *u;
-    struct Client *c = (struct Client *)data;
-
-    u = webkit_web_view_get_uri(WEBKIT_WEB_VIEW(c->web_view));
-    t = webkit_web_view_get_title(WEBKIT_WEB_VIEW(c->web_view));
-
-    u = u == NULL ? __NAME__ : u;
-    u = u[0] == 0 ? __NAME__ : u;
+    struct BatchJob *j = (struct BatchJob *)data;
 
-    t = t == NULL ? u : t;
-    t = t[0] == 0 ? u : t;
-
-    gtk_window_set_title(GTK_WINDOW(c->win), t);
+    batch_done(j, j->failed ? "failed" : (j->timed_out ? "timeout" : "ok"));
+    g_object_unref(op);
 }
 
 void
-changed_uri(GObject *obj, GParamSpec *pspec, gpointer data)
+batch_pump(void)
 {
-    const gchar *t;
-    struct Client *c = (struct Client *)data;
-    FILE *fp;
-
-    t = webkit_web_view_get_uri(WEBKIT_WEB_VIEW(c->web_view));
+    struct BatchJob *j;
 
-    /* When a web process crashes, we get a "notify::uri" signal, but we
-     * can no longer read a meaningful URI. It's just an empty string
-     * now. Not updating the location bar in this scenario is important,
-     * because we would override the "WEB PROCESS CRASHED" message. */
-    if (t != NULL && strlen(t) > 0)
+    while (batch_running < batch_jobs && !g_queue_is_empty(&batch_queue))
     {
-        gtk_entry_set_text(GTK_ENTRY(c->location), t);
-
-        if (history_file != NULL)
-        {
-            fp = fopen(history_file, "a");
-            if (fp != NULL)
-            {
-                fprintf(fp, "%s\n", t);
-                fclose(fp);
-            }
-            else
-                perror(__NAME__": Error opening history file");
-        }
+        j = g_queue_pop_head(&batch_queue);
+        j->started = g_get_monotonic_time();
+        batch_running++;
+
+        /* Offscreen windows get rendered like real ones, but they never
+         * show up on the screen. */
+        j->win = gtk_offscreen_window_new();
+        j->web_view = webkit_web_view_new_with_context(web_context);
+        settings_setup(webkit_web_view_get_settings(WEBKIT_WEB_VIEW(j->web_view)));
+        gtk_widget_set_size_request(j->web_view, batch_width, batch_height);
+        gtk_container_add(GTK_CONTAINER(j->win), j->web_view);
+        gtk_widget_show_all(j->win);
+
+        watched_signal_connect(G_OBJECT(j->web_view), "load-changed",
+                               batch_load_changed, j);
+        watched_signal_connect(G_OBJECT(j->web_view), "load-failed",
+                               batch_failed, j);
+        watched_signal_connect(G_OBJECT(j->web_view), "decide-policy",
+                               batch_decide_policy, j);
+        j->timeout = g_timeout_add_seconds(batch_timeout, batch_timed_out, j);
+
+        webkit_web_view_load_uri(WEBKIT_WEB_VIEW(j->web_view), j->uri);
     }
 }
 
-gboolean
-crashed_web_view(WebKitWebView *web_view, gpointer data)
+void
+batch_snapshot_done(GObject *obj, GAsyncResult *res, gpointer data)
 {
-    gchar *t;
-    struct Client *c = (struct Client *)data;
+    struct BatchJob *j = (struct BatchJob *)data;
+    cairo_surface_t *surface;
+    GError *err = NULL;
+    const gchar *status;
 
-    t = g_strdup_printf("WEB PROCESS CRASHED: %s",
-                        webkit_web_view_get_uri(WEBKIT_WEB_VIEW(web_view)));
-    gtk_entry_set_text(GTK_ENTRY(c->location), t);
-    g_free(t);
+    surface = webkit_web_view_get_snapshot_finish(WEBKIT_WEB_VIEW(obj), res,
+                                                  &err);
+    if (surface == NULL)
+    {
+        fprintf(stderr, __NAME__": Could not take snapshot of '%s': %s\n",
+                j->uri, err->message);
+        g_error_free(err);
+        status = "failed";
+    }
+    else
+    {
+        if (cairo_surface_write_to_png(surface, j->path) != CAIRO_STATUS_SUCCESS)
+        {
+            fprintf(stderr, __NAME__": Could not write '%s'\n", j->path);
+            status = "failed";
+        }
+        else
+            status = j->timed_out ? "timeout" : "ok";
+        cairo_surface_destroy(surface);
+    }
 
-    return TRUE;
+    batch_done(j, status);
 }
 
 gboolean
-decide_policy(WebKitWebView *web_view, WebKitPolicyDecision *decision,
-              WebKitPolicyDecisionType type, gpointer data)
+batch_stdin(GIOChannel *channel, GIOCondition condition, gpointer data)
 {
-    WebKitResponsePolicyDecision *r;
+    gchar *uri = NULL;
 
-    switch (type)
+    if (g_io_channel_read_line(channel, &uri, NULL, NULL, NULL) !=
+        G_IO_STATUS_NORMAL)
     {
-        case WEBKIT_POLICY_DECISION_TYPE_RESPONSE:
-            r = WEBKIT_RESPONSE_POLICY_DECISION(decision);
-            if (!webkit_response_policy_decision_is_mime_type_supported(r))
-                webkit_policy_decision_download(decision);
-            else
-                webkit_policy_decision_use(decision);
-            break;
-        default:
-            /* Use whatever default there is. */
-            return FALSE;
+        g_io_channel_shutdown(channel, FALSE, NULL);
+        batch_input_open = FALSE;
+        batch_check_done(NULL);
+        return FALSE;
     }
+
+    g_strstrip(uri);
+    if (uri[0] != 0)
+        batch_add(uri);
+    g_free(uri);
+
     return TRUE;
 }
 
 void
-download_handle_finished(WebKitDownload *download, gpointer data)
+batch_reject(gpointer data)
 {
-    downloads--;
+    struct BatchJob *j = (struct BatchJob *)data;
+
+    /* There might not be any load events after this, so don't wait for
+     * the timeout. The view can't be destroyed from within its own
+     * signal handler, though. */
+    g_signal_handlers_disconnect_by_data(G_OBJECT(j->web_view), j);
+    if (j->timeout != 0)
+    {
+        g_source_remove(j->timeout);
+        j->timeout = 0;
+    }
+    g_idle_add(batch_rejected, j);
 }
 
-void
-download_handle_start(WebKitWebView *web_view, WebKitDownload *download,
-                      gpointer data)
+gboolean
+batch_rejected(gpointer data)
 {
-    g_signal_connect(G_OBJECT(download), "decide-destination",
-                     G_CALLBACK(download_handle), data);
+    batch_done(data, "failed");
+    return G_SOURCE_REMOVE;
 }
 
 gboolean
-download_handle(WebKitDownload *download, gchar *suggested_filename, gpointer data)
+batch_timed_out(gpointer data)
 {
-    gchar *sug_clean, *path, *path2 = NULL, *uri;
-    GtkToolItem *tb;
-    int suffix = 1;
-    size_t i;
+    struct BatchJob *j = (struct BatchJob *)data;
 
-    sug_clean = g_strdup(suggested_filename);
-    for (i = 0; i < strlen(sug_clean); i++)
-        if (sug_clean[i] == G_DIR_SEPARATOR)
-            sug_clean[i] = '_';
+    /* Take whatever has been rendered so far. */
+    j->timeout = 0;
+    j->timed_out = TRUE;
+    webkit_web_view_stop_loading(WEBKIT_WEB_VIEW(j->web_view));
+    batch_capture(j);
 
-    path = g_build_filename(download_dir, sug_clean, NULL);
-    path2 = g_strdup(path);
-    while (g_file_test(path2, G_FILE_TEST_EXISTS) && suffix < 1000)
-    {
-        g_free(path2);
+    return G_SOURCE_REMOVE;
+}
 
-        path2 = g_strdup_printf("%s.%d", path, suffix);
-        suffix++;
-    }
+void
+cache_clear_done(GObject *obj, GAsyncResult *res, gpointer data)
+{
+    GtkWidget *location = GTK_WIDGET(data);
+    GError *err = NULL;
+    gchar *t;
 
-    if (suffix == 1000)
+    if (!webkit_website_data_manager_clear_finish(
+            WEBKIT_WEBSITE_DATA_MANAGER(obj), res, &err))
     {
-        fprintf(stderr, __NAME__": Suffix reached limit for download.\n");
-        webkit_download_cancel(download);
+        t = g_strdup_printf("Could not clear cache: %s", err->message);
+        gtk_entry_set_text(GTK_ENTRY(location), t);
+        g_free(t);
+        g_error_free(err);
     }
     else
-    {
-        uri = g_filename_to_uri(path2, NULL, NULL);
-        webkit_download_set_destination(download, uri);
-        g_free(uri);
-
-        tb = gtk_tool_button_new(NULL, NULL);
-        gtk_tool_button_set_icon_name(GTK_TOOL_BUTTON(tb), "gtk-delete");
-        gtk_tool_button_set_label(GTK_TOOL_BUTTON(tb), sug_clean);
-        gtk_toolbar_insert(GTK_TOOLBAR(dm.toolbar), tb, 0);
-        gtk_widget_show_all(dm.win);
+        gtk_entry_set_text(GTK_ENTRY(location), "Cache cleared");
 
-        g_signal_connect(G_OBJECT(download), "notify::estimated-progress",
-                         G_CALLBACK(changed_download_progress), tb);
-
-        downloads++;
-        g_signal_connect(G_OBJECT(download), "finished",
-                         G_CALLBACK(download_handle_finished), NULL);
+    g_object_unref(location);
+}
 
-        g_object_ref(download);
-        g_signal_connect(G_OBJECT(tb), "clicked",
-                         G_CALLBACK(downloadmanager_cancel), download);
-    }
+gint
+cache_size_cmp(gconstpointer a, gconstpointer b)
+{
+    guint64 sa, sb;
 
-    g_free(sug_clean);
-    g_free(path);
-    g_free(path2);
+    sa = webkit_website_data_get_size((WebKitWebsiteData *)a,
+                                      WEBKIT_WEBSITE_DATA_DISK_CACHE);
+    sb = webkit_website_data_get_size((WebKitWebsiteData *)b,
+                                      WEBKIT_WEBSITE_DATA_DISK_CACHE);
 
-    /* Propagate -- to whom it may concern. */
-    return FALSE;
+    /* Largest first. */
+    return sa < sb ? 1 : (sa > sb ? -1 : 0);
 }
 
 void
-downloadmanager_cancel(GtkToolButton *tb, gpointer data)
+cache_stats_fetched(GObject *obj, GAsyncResult *res, gpointer data)
 {
-    WebKitDownload *download = WEBKIT_DOWNLOAD(data);
+    GtkWidget *location = GTK_WIDGET(data);
+    GError *err = NULL;
+    GList *all, *it;
+    guint64 total = 0;
+    gchar *t, *cap;
 
-    webkit_download_cancel(download);
-    g_object_unref(download);
+    all = webkit_website_data_manager_fetch_finish(
+        WEBKIT_WEBSITE_DATA_MANAGER(obj), res, &err);
+    if (err != NULL)
+    {
+        t = g_strdup_printf("Could not fetch cache statistics: %s",
+                            err->message);
+        g_error_free(err);
+    }
+    else
+    {
+        for (it = all; it != NULL; it = g_list_next(it))
+            total += webkit_website_data_get_size(
+                (WebKitWebsiteData *)it->data, WEBKIT_WEBSITE_DATA_DISK_CACHE);
 
-    gtk_widget_destroy(GTK_WIDGET(tb));
+        if (cache_size_max > 0)
+            cap = g_strdup_printf("%.1f MB", cache_size_max / 1e6);
+        else
+            cap = g_strdup("none");
+        t = g_strdup_printf("Disk cache: %.1f MB in %u origins, limit: %s%s",
+                            total / 1e6, g_list_length(all), cap,
+                            cache_ephemeral ? " (ephemeral)" : "");
+        g_free(cap);
+        g_list_free_full(all, (GDestroyNotify)webkit_website_data_unref);
+    }
+
+    gtk_entry_set_text(GTK_ENTRY(location), t);
+    g_free(t);
+    g_object_unref(location);
 }
 
 gboolean
-downloadmanager_delete(GtkWidget *obj, gpointer data)
+cache_trim(gpointer data)
 {
-    if (!quit_if_nothing_active())
-        gtk_widget_hide(dm.win);
+    webkit_website_data_manager_fetch(
+        webkit_web_context_get_website_data_manager(web_context),
+        WEBKIT_WEBSITE_DATA_DISK_CACHE, NULL, cache_trim_fetched, NULL);
 
-    return TRUE;
+    return G_SOURCE_CONTINUE;
 }
 
 void
-downloadmanager_setup(void)
+cache_trim_fetched(GObject *obj, GAsyncResult *res, gpointer data)
 {
-    dm.win = gtk_window_new(GTK_WINDOW_TOPLEVEL);
-    gtk_window_set_type_hint(GTK_WINDOW(dm.win), GDK_WINDOW_TYPE_HINT_DIALOG);
-    gtk_window_set_default_size(GTK_WINDOW(dm.win), 500, 250);
-    gtk_window_set_title(GTK_WINDOW(dm.win), __NAME__" - Download Manager");
-    g_signal_connect(G_OBJECT(dm.win), "delete-event",
-                     G_CALLBACK(downloadmanager_delete), NULL);
-    g_signal_connect(G_OBJECT(dm.win), "key-press-event",
-                     G_CALLBACK(key_downloadmanager), NULL);
-
-    dm.toolbar = gtk_toolbar_new();
-    gtk_orientable_set_orientation(GTK_ORIENTABLE(dm.toolbar),
-                                   GTK_ORIENTATION_VERTICAL);
-    gtk_toolbar_set_style(GTK_TOOLBAR(dm.toolbar), GTK_TOOLBAR_BOTH_HORIZ);
-    gtk_toolbar_set_show_arrow(GTK_TOOLBAR(dm.toolbar), FALSE);
-
-    dm.scroll = gtk_scrolled_window_new(NULL, NULL);
-    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(dm.scroll),
-                                   GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
-    gtk_container_add(GTK_CONTAINER(dm.scroll), dm.toolbar);
+    WebKitWebsiteDataManager *m = WEBKIT_WEBSITE_DATA_MANAGER(obj);
+    GError *err = NULL;
+    GList *all, *it, *evict = NULL;
+    guint64 total = 0;
 
-    gtk_container_add(GTK_CONTAINER(dm.win), dm.scroll);
-}
+    all = webkit_website_data_manager_fetch_finish(m, res, &err);
+    if (err != NULL)
+    {
+        fprintf(stderr, __NAME__": Could not fetch cache size: %s\n",
+                err->message);
+        g_error_free(err);
+        return;
+    }
 
-gchar *
-ensure_uri_scheme(const gchar *t)
-{
-    gchar *f, *fabs;
+    for (it = all; it != NULL; it = g_list_next(it))
+        total += webkit_website_data_get_size((WebKitWebsiteData *)it->data,
+                                              WEBKIT_WEBSITE_DATA_DISK_CACHE);
 
-    f = g_ascii_strdown(t, -1);
-    if (!g_str_has_prefix(f, "http:") &&
-        !g_str_has_prefix(f, "https:") &&
-        !g_str_has_prefix(f, "file:") &&
-        !g_str_has_prefix(f, "about:"))
+    if (total > cache_size_max)
     {
-        g_free(f);
-        fabs = realpath(t, NULL);
-        if (fabs != NULL)
+        /* WebKit has no notion of a size limit for its disk cache, so we
+         * throw out the biggest origins until we're well below ours. */
+        all = g_list_sort(all, cache_size_cmp);
+        for (it = all; it != NULL && total > cache_size_max * 0.8;
+             it = g_list_next(it))
         {
-            f = g_strdup_printf("file://%s", fabs);
-            free(fabs);
+            total -= webkit_website_data_get_size(
+                (WebKitWebsiteData *)it->data, WEBKIT_WEBSITE_DATA_DISK_CACHE);
+            evict = g_list_prepend(evict, it->data);
         }
-        else
-            f = g_strdup_printf("http://%s", t);
-        return f;
+        webkit_website_data_manager_remove(m, WEBKIT_WEBSITE_DATA_DISK_CACHE,
+                                           evict, NULL, NULL, NULL);
+        g_list_free(evict);
     }
-    else
-        return g_strdup(t);
+
+    g_list_free_full(all, (GDestroyNotify)webkit_website_data_unref);
 }
 
 void
-external_handler_run(GtkAction *action, gpointer data)
+client_connect_web_view(gpointer data)
 {
     struct Client *c = (struct Client *)data;
-    gchar *argv[] = { "lariza-external-handler", "-u", NULL, NULL };
-    GPid pid;
-    GError *err = NULL;
-
-    (void)action;
-
-    argv[2] = c->external_handler_uri;
-    if (!g_spawn_async(NULL, argv, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL,
-                       &pid, &err))
-    {
-        fprintf(stderr, __NAME__": Could not launch key handler: %s\n",
-                err->message);
-        g_error_free(err);
-    }
-    else
-        g_spawn_close_pid(pid);
+    WebKitFindController *fc;
+
+    watched_signal_connect(G_OBJECT(c->web_view), "notify::title",
+                           changed_title, c);
+    watched_signal_connect(G_OBJECT(c->web_view), "notify::uri",
+                           changed_uri, c);
+    watched_signal_connect(G_OBJECT(c->web_view), "notify::estimated-load-progress",
+                           changed_load_progress, c);
+    watched_signal_connect(G_OBJECT(c->web_view), "load-changed",
+                           changed_load_state, c);
+    watched_signal_connect(G_OBJECT(c->web_view), "load-failed",
+                           pagecache_failed, c);
+    watched_signal_connect(G_OBJECT(c->web_view), "create",
+                           client_new_request, NULL);
+    watched_signal_connect(G_OBJECT(c->web_view), "context-menu",
+                           menu_web_view, c);
+    watched_signal_connect(G_OBJECT(c->web_view), "close",
+                           client_destroy_request, c);
+    watched_signal_connect(G_OBJECT(c->web_view), "decide-policy",
+                           decide_policy, NULL);
+    watched_signal_connect(G_OBJECT(c->web_view), "key-press-event",
+                           key_web_view, c);
+    watched_signal_connect(G_OBJECT(c->web_view), "button-press-event",
+                           key_web_view, c);
+    watched_signal_connect(G_OBJECT(c->web_view), "scroll-event",
+                           key_web_view, c);
+    watched_signal_connect(G_OBJECT(c->web_view), "mouse-target-changed",
+                           hover_web_view, c);
+    watched_signal_connect(G_OBJECT(c->web_view), "web-process-crashed",
+                           crashed_web_view, c);
+
+    fc = webkit_web_view_get_find_controller(WEBKIT_WEB_VIEW(c->web_view));
+    watched_signal_connect(G_OBJECT(fc), "found-text",
+                           search_counted, c);
+    watched_signal_connect(G_OBJECT(fc), "counted-matches",
+                           search_counted, c);
+    watched_signal_connect(G_OBJECT(fc), "failed-to-find-text",
+                           search_failed, c);
 }
 
 void
-grab_environment_configuration(void)
+client_destroy(GtkWidget *widget, gpointer data)
 {
-    const gchar *e;
-
-    e = g_getenv(__NAME_UPPERCASE__"_ACCEPTED_LANGUAGE");
-    if (e != NULL)
-        accepted_language[0] = g_strdup(e);
+    struct Client *c = (struct Client *)data;
 
-    e = g_getenv(__NAME_UPPERCASE__"_DOWNLOAD_DIR");
-    if (e != NULL)
-        download_dir = g_strdup(e);
+    trace_event('i', "client", "client_destroy", c, NULL);
 
-    e = g_getenv(__NAME_UPPERCASE__"_ENABLE_EXPERIMENTAL_WEBGL");
-    if (e != NULL)
-        enable_webgl = TRUE;
+    g_signal_handlers_disconnect_by_func(G_OBJECT(c->web_view),
+                                         changed_load_progress, c);
+    g_signal_handlers_disconnect_by_func(G_OBJECT(c->web_view),
+                                         changed_load_state, c);
+
+    metrics_write(c);
+    g_free(c->metrics_uri);
+    g_free(c->background_uri);
+    g_free(c->load_queued);
+    load_release(c);
+    client_list = g_list_remove(client_list, c);
+
+    if (c->crash_timer != 0)
+        g_source_remove(c->crash_timer);
+    if (c->pagecache_timer != 0)
+        g_source_remove(c->pagecache_timer);
+    if (c->prefetch_timer != 0)
+        g_source_remove(c->prefetch_timer);
+    preload_discard(c);
+    if (c->search_timer != 0)
+        g_source_remove(c->search_timer);
+
+    if (c->ui_tick != 0)
+        gtk_widget_remove_tick_callback(c->win, c->ui_tick);
+    if (c->external_handler_action != NULL)
+        g_object_unref(c->external_handler_action);
+    g_free(c->external_handler_uri);
+    g_free(c->hover_uri);
+    g_free(c->profile_host);
+    g_free(c->ui_location);
+    g_free(c->ui_title);
 
-    e = g_getenv(__NAME_UPPERCASE__"_FIFO_SUFFIX");
-    if (e != NULL)
-        fifo_suffix = g_strdup(e);
+    free(c);
+    alloc_count(ALLOC_CLIENT, -1);
+    clients--;
 
-    e = g_getenv(__NAME_UPPERCASE__"_HISTORY_FILE");
-    if (e != NULL)
-        history_file = g_strdup(e);
+    quit_if_nothing_active();
+}
 
-    e = g_getenv(__NAME_UPPERCASE__"_HOME_URI");
-    if (e != NULL)
-        home_uri = g_strdup(e);
+gboolean
+client_destroy_request(WebKitWebView *web_view, gpointer data)
+{
+    struct Client *c = (struct Client *)data;
 
-    e = g_getenv(__NAME_UPPERCASE__"_USER_AGENT");
-    if (e != NULL)
-        user_agent = g_strdup(e);
+    gtk_widget_destroy(c->win);
 
-    e = g_getenv(__NAME_UPPERCASE__"_ZOOM");
-    if (e != NULL)
-        global_zoom = atof(e);
+    return TRUE;
 }
 
-void
-hover_web_view(WebKitWebView *web_view, WebKitHitTestResult *ht, guint modifiers,
-               gpointer data)
+WebKitWebView *
+client_new(const gchar *uri, WebKitWebView *related_wv, gboolean show,
+           gboolean background)
 {
-    struct Client *c = (struct Client *)data;
+    struct Client *c;
+    WebKitWebContext *wc;
+    WebKitSettings *settings;
+    GtkWidget *hbox;
+    GList *it;
+    gchar *f;
 
-    if (!gtk_widget_is_focus(c->location))
+    if (uri != NULL && cooperative_instances && !cooperative_alone)
     {
-        if (webkit_hit_test_result_context_is_link(ht))
-        {
-            gtk_entry_set_text(GTK_ENTRY(c->location),
-                               webkit_hit_test_result_get_link_uri(ht));
+        f = ensure_uri_scheme(uri);
+        write(cooperative_pipe_fp, f, strlen(f));
+        write(cooperative_pipe_fp, "\n", 1);
+        g_free(f);
+        return NULL;
+    }
 
-            if (c->hover_uri != NULL)
-                g_free(c->hover_uri);
-            c->hover_uri = g_strdup(webkit_hit_test_result_get_link_uri(ht));
-        }
-        else
+    /* Don't bother creating a window and a web process only to have
+     * the extension block the page. This must not ask the file system,
+     * so anything ambiguous is left to load_blocked(). */
+    if (uri != NULL && (f = uri_classify_lexical(uri)) != NULL)
+    {
+        if (adblock_match(f, NULL, ADBLOCK_DOCUMENT))
         {
-            gtk_entry_set_text(GTK_ENTRY(c->location),
-                               webkit_web_view_get_uri(WEBKIT_WEB_VIEW(c->web_view)));
-
-            if (c->hover_uri != NULL)
-                g_free(c->hover_uri);
-            c->hover_uri = NULL;
+            trace_event('i', "adblock", "blocked", NULL, f);
+            fprintf(stderr, __NAME__": Blocked '%s'\n", f);
+            g_free(f);
+            return NULL;
         }
+        g_free(f);
     }
-}
 
-gboolean
-key_common(GtkWidget *widget, GdkEvent *event, gpointer data)
-{
-    struct Client *c = (struct Client *)data;
-    WebKitWebContext *wc = webkit_web_view_get_context(WEBKIT_WEB_VIEW(c->web_view));
-    gchar *f;
+    c = calloc(1, sizeof(struct Client));
+    if (!c)
+    {
+        fprintf(stderr, __NAME__": fatal: calloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+    alloc_count(ALLOC_CLIENT, 1);
 
-    if (event->type == GDK_KEY_PRESS)
+    trace_event('i', "client", "client_new", c, uri);
+
+    if (embed != 0)
     {
-        if (((GdkEventKey *)event)->state & GDK_MOD1_MASK)
+        c->win = gtk_plug_new(embed);
+        if (!gtk_plug_get_embedded(GTK_PLUG(c->win)))
         {
-            switch (((GdkEventKey *)event)->keyval)
-            {
-                case GDK_KEY_q:  /* close window (left hand) */
-                    gtk_widget_destroy(c->win);
-                    return TRUE;
-                case GDK_KEY_w:  /* home (left hand) */
-                    f = ensure_uri_scheme(home_uri);
-                    webkit_web_view_load_uri(WEBKIT_WEB_VIEW(c->web_view), f);
-                    g_free(f);
-                    return TRUE;
-                case GDK_KEY_e:  /* new tab (left hand) */
-                    f = ensure_uri_scheme(home_uri);
-                    client_new(f, NULL, TRUE);
-                    g_free(f);
+            fprintf(stderr, __NAME__": Can't plug-in to XID %ld.\n", embed);
+            gtk_widget_destroy(c->win);
+            c->win = NULL;
+            embed = 0;
+        }
+    }
+
+    if (c->win == NULL)
+        c->win = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+
+    c->ui_progress = -1;
+
+    gtk_window_set_default_size(GTK_WINDOW(c->win), 800, 600);
+
+    watched_signal_connect(G_OBJECT(c->win), "destroy", client_destroy, c);
+    gtk_window_set_title(GTK_WINDOW(c->win), __NAME__);
+
+    /* Views that are related share a web process. */
+    if (related_wv == NULL)
+        related_wv = client_related_view(uri);
+
+    if (related_wv == NULL)
+        c->web_view = webkit_web_view_new_with_context(web_context);
+    else
+        c->web_view = webkit_web_view_new_with_related_view(related_wv);
+
+    for (it = client_list; related_wv != NULL && it != NULL; it = g_list_next(it))
+        if (((struct Client *)it->data)->web_view == GTK_WIDGET(related_wv))
+            c->process_group = ((struct Client *)it->data)->process_group;
+    if (c->process_group == 0)
+        c->process_group = ++process_group_next;
+    wc = webkit_web_view_get_context(WEBKIT_WEB_VIEW(c->web_view));
+
+    webkit_web_view_set_zoom_level(WEBKIT_WEB_VIEW(c->web_view), global_zoom);
+    client_connect_web_view(c);
+
+    if (!initial_wc_setup_done)
+    {
+        if (accepted_language[0] != NULL)
+            webkit_web_context_set_preferred_languages(wc, accepted_language);
+
+        watched_signal_connect(G_OBJECT(wc), "download-started",
+                               download_handle_start, NULL);
+
+        trust_user_certs(wc);
+
+        initial_wc_setup_done = TRUE;
+    }
+
+    /* Related views share a settings object. profiles_apply() changes
+     * the settings of a single window, so each one needs its own. */
+    settings = settings_new();
+    webkit_web_view_set_settings(WEBKIT_WEB_VIEW(c->web_view), settings);
+    g_object_unref(settings);
+
+    c->location = gtk_entry_new();
+    watched_signal_connect(G_OBJECT(c->location), "key-press-event",
+                           key_location, c);
+    watched_signal_connect(G_OBJECT(c->location), "changed",
+                           search_changed, c);
+    watched_signal_connect(G_OBJECT(c->location), "changed",
+                           preload_changed, c);
+
+    /* Only visible while searching. */
+    c->search_label = gtk_label_new(NULL);
+    gtk_widget_set_no_show_all(c->search_label, TRUE);
+
+    hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
+    gtk_box_pack_start(GTK_BOX(hbox), c->location, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(hbox), c->search_label, FALSE, FALSE, 0);
+
+    c->vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+    gtk_box_pack_start(GTK_BOX(c->vbox), hbox, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(c->vbox), c->web_view, TRUE, TRUE, 0);
+
+    gtk_container_add(GTK_CONTAINER(c->win), c->vbox);
+
+    if (frame_stats)
+    {
+        watched_signal_connect(G_OBJECT(c->win), "realize", frame_realize, c);
+        watched_signal_connect(G_OBJECT(c->win), "unrealize", frame_unrealize, c);
+    }
+
+    if (show && background)
+    {
+        gtk_window_set_focus_on_map(GTK_WINDOW(c->win), FALSE);
+        gtk_widget_show_all(c->win);
+    }
+    else if (show)
+        show_web_view(NULL, c);
+    else
+        watched_signal_connect(G_OBJECT(c->web_view), "ready-to-show",
+                               show_web_view, c);
+
+    if (uri != NULL && background)
+    {
+        /* Don't compete with the page being read. Loading starts when
+         * the window is focused or when nothing else is loading. */
+        c->background_uri = g_strdup(uri);
+        gtk_entry_set_text(GTK_ENTRY(c->location), uri);
+        watched_signal_connect(G_OBJECT(c->win), "focus-in-event",
+                               background_focus, c);
+        background_schedule();
+    }
+    else if (uri != NULL)
+        load_request(c, uri);
+
+    clients++;
+    client_list = g_list_prepend(client_list, c);
+
+    return WEBKIT_WEB_VIEW(c->web_view);
+}
+
+WebKitWebView *
+client_new_request(WebKitWebView *web_view,
+                   WebKitNavigationAction *navigation_action, gpointer data)
+{
+    const gchar *uri;
+
+    /* Popups opened by scripts don't necessarily go through
+     * decide_policy(). The opener decides whether it's third-party. */
+    uri = webkit_uri_request_get_uri(
+        webkit_navigation_action_get_request(navigation_action));
+    if (uri != NULL && uri[0] != 0 &&
+        adblock_match(uri, webkit_web_view_get_uri(web_view),
+                      ADBLOCK_DOCUMENT))
+    {
+        trace_event('i', "adblock", "blocked", NULL, uri);
+        return NULL;
+    }
+
+    return client_new(NULL, web_view, FALSE, FALSE);
+}
+
+WebKitWebView *
+client_related_view(const gchar *uri)
+{
+    struct Client *c, *least = NULL;
+    WebKitWebView *wv;
+    GHashTable *groups;
+    GList *it;
+    guint n, least_n = 0;
+
+    /* WebKitGTK gives every view that isn't related to another one its
+     * own web process, it ignores its process model and limit. So we
+     * pick the view to relate to ourselves. */
+    if (client_list == NULL)
+        return NULL;
+
+    if (process_shared)
+        return WEBKIT_WEB_VIEW(((struct Client *)client_list->data)->web_view);
+
+    if (process_per_site && uri != NULL &&
+        (wv = client_same_site(uri)) != NULL)
+        return wv;
+
+    if (process_limit == 0)
+        return NULL;
+
+    /* Once there are enough web processes, add to the one with the
+     * fewest windows. */
+    groups = g_hash_table_new(g_direct_hash, g_direct_equal);
+    for (it = client_list; it != NULL; it = g_list_next(it))
+    {
+        c = (struct Client *)it->data;
+        n = GPOINTER_TO_UINT(g_hash_table_lookup(
+            groups, GUINT_TO_POINTER(c->process_group)));
+        g_hash_table_insert(groups, GUINT_TO_POINTER(c->process_group),
+                            GUINT_TO_POINTER(n + 1));
+    }
+
+    if (g_hash_table_size(groups) >= process_limit)
+    {
+        for (it = client_list; it != NULL; it = g_list_next(it))
+        {
+            c = (struct Client *)it->data;
+            n = GPOINTER_TO_UINT(g_hash_table_lookup(
+                groups, GUINT_TO_POINTER(c->process_group)));
+            if (least == NULL || n < least_n)
+            {
+                least = c;
+                least_n = n;
+            }
+        }
+    }
+    g_hash_table_destroy(groups);
+
+    return least != NULL ? WEBKIT_WEB_VIEW(least->web_view) : NULL;
+}
+
+WebKitWebView *
+client_same_site(const gchar *uri)
+{
+    struct Client *c;
+    WebKitWebView *found = NULL;
+    GList *it;
+    gchar *f, *host, *other;
+    const gchar *base, *u;
+
+    /* uri may be anything the user typed. Whether "example.com" is a
+     * file can only be told by asking the file system, which we must
+     * not do here. Assuming a host name is harmless, though. */
+    f = uri_classify_lexical(uri);
+    if (f == NULL)
+        f = g_strdup_printf("http://%s", uri);
+    host = uri_host(f);
+    g_free(f);
+    if (host == NULL)
+        return NULL;
+
+    /* Sites are compared by their registrable domain. IP addresses and
+     * unknown suffixes have none, so the host name has to match. */
+    base = soup_tld_get_base_domain(host, NULL);
+    base = base != NULL ? base : host;
+
+    for (it = client_list; found == NULL && it != NULL; it = g_list_next(it))
+    {
+        c = (struct Client *)it->data;
+        u = webkit_web_view_get_uri(WEBKIT_WEB_VIEW(c->web_view));
+        if (u == NULL || (other = uri_host(u)) == NULL)
+            continue;
+
+        u = soup_tld_get_base_domain(other, NULL);
+        if (strcmp(u != NULL ? u : other, base) == 0)
+            found = WEBKIT_WEB_VIEW(c->web_view);
+        g_free(other);
+    }
+
+    g_free(host);
+    return found;
+}
+
+gboolean
+command_run(gpointer data, const gchar *t)
+{
+    struct Client *c = (struct Client *)data;
+    WebKitWebsiteDataManager *m;
+    GList *it;
+    guint shared;
+    gchar *f;
+
+    m = webkit_web_context_get_website_data_manager(web_context);
+
+    if (strcmp(t, "cache") == 0)
+    {
+        webkit_website_data_manager_fetch(m, WEBKIT_WEBSITE_DATA_DISK_CACHE,
+                                          NULL, cache_stats_fetched,
+                                          g_object_ref(c->location));
+        return TRUE;
+    }
+    else if (strcmp(t, "cache clear") == 0)
+    {
+        webkit_website_data_manager_clear(m, WEBKIT_WEBSITE_DATA_MEMORY_CACHE |
+                                          WEBKIT_WEBSITE_DATA_DISK_CACHE,
+                                          0, NULL, cache_clear_done,
+                                          g_object_ref(c->location));
+        return TRUE;
+    }
+    else if (strcmp(t, "watchdog") == 0)
+    {
+        if (watchdog_threshold_us == 0)
+            gtk_entry_set_text(GTK_ENTRY(c->location), "Watchdog is disabled");
+        else
+        {
+            watchdog_dump();
+            gtk_entry_set_text(GTK_ENTRY(c->location),
+                               "Watchdog statistics written to stderr");
+        }
+        return TRUE;
+    }
+    else if (strcmp(t, "metrics") == 0)
+    {
+        f = g_strdup_printf("Requests: %u, blocked: %u, matching: %.1f ms",
+                            c->metrics_requests, c->metrics_blocked,
+                            c->metrics_match_us / 1e3);
+        gtk_entry_set_text(GTK_ENTRY(c->location), f);
+        g_free(f);
+        return TRUE;
+    }
+    else if (strcmp(t, "memory") == 0)
+    {
+        if (c->memory_pid == 0 || c->memory_rss_kb == 0)
+            f = g_strdup("Memory usage of this window is not known yet");
+        else
+        {
+            for (it = client_list, shared = 0; it != NULL; it = g_list_next(it))
+                if (((struct Client *)it->data)->memory_pid == c->memory_pid)
+                    shared++;
+            f = g_strdup_printf("Web process %d: RSS %.1f MiB, PSS %.1f MiB, "
+                                "%u window(s)", c->memory_pid,
+                                c->memory_rss_kb / 1024.0,
+                                c->memory_pss_kb / 1024.0, shared);
+        }
+        gtk_entry_set_text(GTK_ENTRY(c->location), f);
+        g_free(f);
+        return TRUE;
+    }
+    else if (strcmp(t, "frames") == 0)
+    {
+        if (!frame_stats)
+            f = g_strdup("Frame statistics are disabled");
+        else if (c->frame_count == 0)
+            f = g_strdup("No frames since last time");
+        else
+            f = g_strdup_printf("Profile %s: %u frames, mean %.1f ms, "
+                                "worst %.1f ms, %u slow",
+                                rendering_profile != NULL ?
+                                rendering_profile->name : "default",
+                                c->frame_count,
+                                c->frame_total_us / 1e3 / c->frame_count,
+                                c->frame_max_us / 1e3, c->frame_slow);
+        gtk_entry_set_text(GTK_ENTRY(c->location), f);
+        g_free(f);
+
+        c->frame_count = 0;
+        c->frame_max_us = 0;
+        c->frame_slow = 0;
+        c->frame_total_us = 0;
+        return TRUE;
+    }
+    else if (strcmp(t, "pagecache") == 0)
+    {
+        f = g_strdup_printf("Page cache: %u hits, %u misses, %u evictions",
+                            pagecache_hits, pagecache_misses,
+                            pagecache_evictions);
+        gtk_entry_set_text(GTK_ENTRY(c->location), f);
+        g_free(f);
+        return TRUE;
+    }
+    else if (strcmp(t, "crashes") == 0)
+    {
+        if (crash_recovered == 0)
+            f = g_strdup_printf("Web process crashes: %u, none recovered",
+                                crash_count);
+        else
+            f = g_strdup_printf("Web process crashes: %u, recovered: %u, "
+                                "mean %.1f s, worst %.1f s", crash_count,
+                                crash_recovered,
+                                crash_recovery_total_us / 1e6 / crash_recovered,
+                                crash_recovery_max_us / 1e6);
+        gtk_entry_set_text(GTK_ENTRY(c->location), f);
+        g_free(f);
+        return TRUE;
+    }
+    else if (strcmp(t, "alloc") == 0)
+    {
+        alloc_dump();
+        gtk_entry_set_text(GTK_ENTRY(c->location),
+                           "Allocation counters written to stderr");
+        return TRUE;
+    }
+    else if (strcmp(t, "memory all") == 0)
+    {
+        memory_dump();
+        gtk_entry_set_text(GTK_ENTRY(c->location),
+                           "Memory usage written to stderr");
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+void
+cooperation_setup(void)
+{
+    GIOChannel *towatch;
+    gchar *fifofilename, *fifopath;
+
+    fifofilename = g_strdup_printf("%s-%s", __NAME__".fifo", fifo_suffix);
+    fifopath = g_build_filename(g_get_user_runtime_dir(), fifofilename, NULL);
+    g_free(fifofilename);
+
+    if (!g_file_test(fifopath, G_FILE_TEST_EXISTS))
+        mkfifo(fifopath, 0600);
+
+    cooperative_pipe_fp = open(fifopath, O_WRONLY | O_NONBLOCK);
+    if (!cooperative_pipe_fp)
+    {
+        fprintf(stderr, __NAME__": Can't open FIFO at all.\n");
+    }
+    else
+    {
+        if (write(cooperative_pipe_fp, "", 0) == -1)
+        {
+            /* Could not do an empty write to the FIFO which means there's
+             * no one listening. */
+            close(cooperative_pipe_fp);
+            towatch = g_io_channel_new_file(fifopath, "r+", NULL);
+            g_io_add_watch(towatch, G_IO_IN, (GIOFunc)remote_msg, NULL);
+        }
+        else
+            cooperative_alone = FALSE;
+    }
+
+    g_free(fifopath);
+}
+
+void
+changed_download_progress(GObject *obj, GParamSpec *pspec, gpointer data)
+{
+    WebKitDownload *download = WEBKIT_DOWNLOAD(obj);
+    WebKitURIResponse *resp;
+    GtkToolItem *tb = GTK_TOOL_ITEM(data);
+    gdouble p, size_mb;
+    const gchar *uri;
+    gchar *t, *filename, *base;
+
+    p = webkit_download_get_estimated_progress(download);
+    p = p > 1 ? 1 : p;
+    p = p < 0 ? 0 : p;
+    p *= 100;
+    resp = webkit_download_get_response(download);
+    size_mb = webkit_uri_response_get_content_length(resp) / 1e6;
+
+    uri = webkit_download_get_destination(download);
+    filename = g_filename_from_uri(uri, NULL, NULL);
+    if (filename == NULL)
+    {
+        /* This really should not happen because WebKit uses that URI to
+         * write to a file... */
+        fprintf(stderr, __NAME__": Could not construct file name from URI!\n");
+        t = g_strdup_printf("%s (%.0f%% of %.1f MB)",
+                            webkit_uri_response_get_uri(resp), p, size_mb);
+    }
+    else
+    {
+        base = g_path_get_basename(filename);
+        t = g_strdup_printf("%s (%.0f%% of %.1f MB)", base, p, size_mb);
+        g_free(filename);
+        g_free(base);
+    }
+    gtk_tool_button_set_label(GTK_TOOL_BUTTON(tb), t);
+    g_free(t);
+}
+
+void
+changed_load_progress(GObject *obj, GParamSpec *pspec, gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+    gdouble p;
+
+    p = webkit_web_view_get_estimated_load_progress(WEBKIT_WEB_VIEW(c->web_view));
+    if (p == 1)
+        p = 0;
+    ui_queue_progress(c, p);
+}
+
+void
+changed_load_state(WebKitWebView *web_view, WebKitLoadEvent load_event,
+                   gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+    gint64 d;
+
+    switch (load_event)
+    {
+        case WEBKIT_LOAD_STARTED:
+            /* Counters from the web extension trickle in for a while
+             * after a page has finished loading, so the previous page
+             * is only accounted for right now. */
+            trace_event('b', "navigation", "load", c,
+                        webkit_web_view_get_uri(web_view));
+
+            /* Stopping the load still gets us to WEBKIT_LOAD_FINISHED,
+             * which releases the slot taken below. */
+            load_blocked(web_view);
+
+            /* Loads started by the page itself, e.g. by following a
+             * link, occupy a slot as well. */
+            if (!c->load_slot)
+            {
+                c->load_slot = TRUE;
+                load_active++;
+            }
+            if (c->load_timer != 0)
+            {
+                g_source_remove(c->load_timer);
+                c->load_timer = 0;
+            }
+
+            metrics_write(c);
+            c->metrics_blocked = 0;
+            c->metrics_match_us = 0;
+            c->metrics_requests = 0;
+
+            /* Highlighted matches are gone with the old page. */
+            c->search_limit = 0;
+            search_status(c);
+            break;
+        case WEBKIT_LOAD_REDIRECTED:
+            load_blocked(web_view);
+            break;
+        case WEBKIT_LOAD_COMMITTED:
+            g_free(c->metrics_uri);
+            c->metrics_uri = g_strdup(webkit_web_view_get_uri(web_view));
+            break;
+        case WEBKIT_LOAD_FINISHED:
+            trace_event('e', "navigation", "load", c, NULL);
+            load_release(c);
+
+            if (c->crash_reloading)
+            {
+                d = g_get_monotonic_time() - c->crash_at;
+                crash_recovered++;
+                crash_recovery_total_us += d;
+                crash_recovery_max_us = MAX(crash_recovery_max_us, d);
+                trace_event('e', "client", "recovery", c, NULL);
+                c->crash_at = 0;
+                c->crash_reloading = FALSE;
+            }
+            background_schedule();
+
+            if (c->pagecache_pending)
+            {
+                if (c->pagecache_miss)
+                    pagecache_misses++;
+                else
+                    pagecache_hits++;
+                pagecache_reset(c);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+void
+changed_title(GObject *obj, GParamSpec *pspec, gpointer data)
+{
+    const gchar *t, *u;
+    struct Client *c = (struct Client *)data;
+
+    u = webkit_web_view_get_uri(WEBKIT_WEB_VIEW(c->web_view));
+    t = webkit_web_view_get_title(WEBKIT_WEB_VIEW(c->web_view));
+
+    u = u == NULL ? __NAME__ : u;
+    u = u[0] == 0 ? __NAME__ : u;
+
+    t = t == NULL ? u : t;
+    t = t[0] == 0 ? u : t;
+
+    ui_queue_title(c, t);
+}
+
+void
+changed_uri(GObject *obj, GParamSpec *pspec, gpointer data)
+{
+    const gchar *t;
+    struct Client *c = (struct Client *)data;
+    FILE *fp;
+
+    t = webkit_web_view_get_uri(WEBKIT_WEB_VIEW(c->web_view));
+
+    /* When a web process crashes, we get a "notify::uri" signal, but we
+     * can no longer read a meaningful URI. It's just an empty string
+     * now. Not updating the location bar in this scenario is important,
+     * because we would override the "WEB PROCESS CRASHED" message. */
+    if (t != NULL && strlen(t) > 0)
+    {
+        ui_queue_location(c, t);
+        profiles_apply(c, t);
+
+        /* Going back to an anchor on the same page doesn't load
+         * anything, so there is neither a hit nor a miss. Whether a
+         * load has started is only known after this signal, though. */
+        if (c->pagecache_pending && c->pagecache_timer == 0)
+            c->pagecache_timer = g_idle_add(pagecache_check, c);
+
+        if (history_file != NULL)
+        {
+            fp = fopen(history_file, "a");
+            if (fp != NULL)
+            {
+                fprintf(fp, "%s\n", t);
+                fclose(fp);
+            }
+            else
+                perror(__NAME__": Error opening history file");
+        }
+    }
+}
+
+gboolean
+crash_recover(gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+
+    /* The back-forward list lives in this process and survives the
+     * crash, so reloading brings back the current page along with its
+     * history. */
+    c->crash_timer = 0;
+    c->crash_reloading = TRUE;
+    webkit_web_view_reload(WEBKIT_WEB_VIEW(c->web_view));
+
+    return G_SOURCE_REMOVE;
+}
+
+gboolean
+crashed_web_view(WebKitWebView *web_view, gpointer data)
+{
+    gchar *t, *host = NULL;
+    struct Client *c = (struct Client *)data, *other;
+    struct CrashHost *h;
+    const gchar *uri;
+    gint64 now = g_get_monotonic_time();
+    gboolean counted;
+    GList *it;
+    guint delay;
+
+    uri = webkit_web_view_get_uri(WEBKIT_WEB_VIEW(web_view));
+    trace_event('i', "client", "crash", c, uri);
+
+    /* All views of a web process get this signal when it crashes. Count
+     * the crash only once, for whichever view comes first. */
+    counted = c->crash_counted_at != 0 &&
+              now - c->crash_counted_at < crash_coalesce;
+    c->crash_counted_at = 0;
+    if (!counted)
+    {
+        crash_count++;
+        for (it = client_list; it != NULL; it = g_list_next(it))
+        {
+            other = (struct Client *)it->data;
+            if (other != c && other->process_group == c->process_group)
+                other->crash_counted_at = now;
+        }
+    }
+
+    /* There won't be a WEBKIT_LOAD_FINISHED for whatever was loading. */
+    load_release(c);
+    c->crash_reloading = FALSE;
+
+    if (uri != NULL)
+        host = uri_host(uri);
+    if (host == NULL)
+        host = g_strdup("");
+
+    if (crash_hosts == NULL)
+        crash_hosts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                            g_free);
+    h = g_hash_table_lookup(crash_hosts, host);
+    if (h == NULL)
+    {
+        h = g_new0(struct CrashHost, 1);
+        g_hash_table_insert(crash_hosts, g_strdup(host), h);
+    }
+    if (h->count == 0 || now - h->since > crash_window)
+    {
+        h->count = 0;
+        h->since = now;
+    }
+    if (!counted || h->count == 0)
+        h->count++;
+
+    if (h->count > crash_retries)
+    {
+        /* Pages that crash over and over again are left alone. */
+        if (c->crash_timer != 0)
+        {
+            g_source_remove(c->crash_timer);
+            c->crash_timer = 0;
+        }
+        if (c->crash_at != 0)
+            trace_event('e', "client", "recovery", c, NULL);
+        c->crash_at = 0;
+        t = g_strdup_printf("WEB PROCESS CRASHED: %s", uri);
+    }
+    else
+    {
+        /* Each crash of the same host within the window doubles the
+         * delay, so a process that dies right away doesn't keep the
+         * machine busy. */
+        delay = crash_backoff_ms << MIN(h->count - 1, 16);
+        delay = MIN(delay, crash_backoff_max_ms);
+
+        if (c->crash_at == 0)
+        {
+            c->crash_at = now;
+            trace_event('b', "client", "recovery", c, uri);
+        }
+        if (c->crash_timer != 0)
+            g_source_remove(c->crash_timer);
+        c->crash_timer = g_timeout_add(delay, crash_recover, c);
+        t = g_strdup_printf("WEB PROCESS CRASHED, reloading in %.1f s: %s",
+                            delay / 1e3, uri);
+    }
+    ui_queue_location(c, t);
+    g_free(t);
+    g_free(host);
+
+    return TRUE;
+}
+
+gboolean
+decide_policy(WebKitWebView *web_view, WebKitPolicyDecision *decision,
+              WebKitPolicyDecisionType type, gpointer data)
+{
+    WebKitResponsePolicyDecision *r;
+    WebKitNavigationAction *a;
+    const gchar *uri;
+
+    switch (type)
+    {
+        case WEBKIT_POLICY_DECISION_TYPE_NEW_WINDOW_ACTION:
+            /* Rejecting blocked pages right here means there's no new
+             * window and no web process for them. Navigations in
+             * existing windows might as well be for an iframe, which
+             * WebKit doesn't tell us. Those are left to load_blocked()
+             * and the extension. As with any popup, the page that
+             * opens it decides whether it's third-party. */
+            a = webkit_navigation_policy_decision_get_navigation_action(
+                WEBKIT_NAVIGATION_POLICY_DECISION(decision));
+            uri = webkit_uri_request_get_uri(webkit_navigation_action_get_request(a));
+            if (!adblock_match(uri, webkit_web_view_get_uri(web_view),
+                               ADBLOCK_DOCUMENT))
+                return FALSE;
+
+            trace_event('i', "adblock", "blocked", NULL, uri);
+            webkit_policy_decision_ignore(decision);
+            break;
+        case WEBKIT_POLICY_DECISION_TYPE_RESPONSE:
+            r = WEBKIT_RESPONSE_POLICY_DECISION(decision);
+            if (!webkit_response_policy_decision_is_mime_type_supported(r))
+                webkit_policy_decision_download(decision);
+            else
+                webkit_policy_decision_use(decision);
+            break;
+        default:
+            /* Use whatever default there is. */
+            return FALSE;
+    }
+    return TRUE;
+}
+
+void
+download_handle_finished(WebKitDownload *download, gpointer data)
+{
+    trace_event('e', "download", "download", download, NULL);
+    downloads--;
+
+    g_object_set_data(G_OBJECT(download), __NAME__"-finished",
+                      GINT_TO_POINTER(TRUE));
+    downloadmanager_trim();
+}
+
+void
+download_handle_start(WebKitWebView *web_view, WebKitDownload *download,
+                      gpointer data)
+{
+    watched_signal_connect(G_OBJECT(download), "decide-destination",
+                           download_handle, data);
+}
+
+gboolean
+download_handle(WebKitDownload *download, gchar *suggested_filename, gpointer data)
+{
+    struct DownloadHash *h;
+    gchar *sug_clean, *path, *path2 = NULL, *uri;
+    GtkToolItem *tb;
+    int suffix = 1;
+    size_t i;
+
+    sug_clean = g_strdup(suggested_filename);
+    for (i = 0; i < strlen(sug_clean); i++)
+        if (sug_clean[i] == G_DIR_SEPARATOR)
+            sug_clean[i] = '_';
+
+    path = g_build_filename(download_dir, sug_clean, NULL);
+    path2 = g_strdup(path);
+    while (g_file_test(path2, G_FILE_TEST_EXISTS) && suffix < 1000)
+    {
+        g_free(path2);
+
+        path2 = g_strdup_printf("%s.%d", path, suffix);
+        suffix++;
+    }
+
+    if (suffix == 1000)
+    {
+        fprintf(stderr, __NAME__": Suffix reached limit for download.\n");
+        webkit_download_cancel(download);
+    }
+    else
+    {
+        uri = g_filename_to_uri(path2, NULL, NULL);
+        webkit_download_set_destination(download, uri);
+        g_free(uri);
+
+        tb = gtk_tool_button_new(NULL, NULL);
+        gtk_tool_button_set_icon_name(GTK_TOOL_BUTTON(tb), "gtk-delete");
+        gtk_tool_button_set_label(GTK_TOOL_BUTTON(tb), sug_clean);
+        gtk_toolbar_insert(GTK_TOOLBAR(dm.toolbar), tb, 0);
+        gtk_widget_show_all(dm.win);
+
+        watched_signal_connect(G_OBJECT(download), "notify::estimated-progress",
+                               changed_download_progress, tb);
+
+        trace_event('b', "download", "download", download, sug_clean);
+        downloads++;
+        watched_signal_connect(G_OBJECT(download), "finished",
+                               download_handle_finished, NULL);
+
+        /* The row keeps the download alive until it is removed. */
+        g_object_set_data_full(G_OBJECT(tb), __NAME__"-download",
+                               g_object_ref(download),
+                               downloadmanager_item_free);
+        alloc_count(ALLOC_DOWNLOAD, 1);
+        watched_signal_connect(G_OBJECT(tb), "clicked",
+                               downloadmanager_cancel, download);
+
+        h = g_new0(struct DownloadHash, 1);
+        alloc_count(ALLOC_DOWNLOAD_HASH, 1);
+        h->checksum = g_checksum_new(G_CHECKSUM_SHA256);
+        h->download = g_object_ref(download);
+        h->fd = -1;
+        h->path = g_strdup(path2);
+        h->tb = g_object_ref(tb);
+        watched_signal_connect(G_OBJECT(download), "notify::estimated-progress",
+                               download_hash_progress, h);
+        watched_signal_connect(G_OBJECT(download), "failed",
+                               download_hash_failed, h);
+        watched_signal_connect(G_OBJECT(download), "finished",
+                               download_hash_finished, h);
+    }
+
+    g_free(sug_clean);
+    g_free(path);
+    g_free(path2);
+
+    /* Propagate -- to whom it may concern. */
+    return FALSE;
+}
+
+void
+download_hash_done(GObject *obj, GAsyncResult *res, gpointer data)
+{
+    struct DownloadHash *h = (struct DownloadHash *)data;
+    const gchar *digest;
+    gchar *t, *base, *sidecar;
+
+    h->busy = FALSE;
+
+    if (h->failed)
+    {
+        download_hash_free(h);
+        return;
+    }
+
+    if (!h->finished)
+        return;
+
+    /* The download might have finished while we were reading. In that
+     * case, do one more run to catch the rest of the file. */
+    if (!h->final)
+    {
+        download_hash_run(h);
+        return;
+    }
+
+    if (h->fd != -1)
+    {
+        digest = g_checksum_get_string(h->checksum);
+
+        if (gtk_widget_get_parent(GTK_WIDGET(h->tb)) != NULL)
+        {
+            t = g_strdup_printf("%s, SHA-256 %s",
+                                gtk_tool_button_get_label(GTK_TOOL_BUTTON(h->tb)),
+                                digest);
+            gtk_tool_button_set_label(GTK_TOOL_BUTTON(h->tb), t);
+            g_free(t);
+        }
+
+        if (download_sidecar)
+        {
+            /* Same format as sha256sum(1), so "sha256sum -c" works. */
+            base = g_path_get_basename(h->path);
+            sidecar = g_strdup_printf("%s.sha256", h->path);
+            t = g_strdup_printf("%s  %s\n", digest, base);
+            if (!g_file_set_contents(sidecar, t, -1, NULL))
+                fprintf(stderr, __NAME__": Could not write '%s'\n", sidecar);
+            g_free(t);
+            g_free(sidecar);
+            g_free(base);
+        }
+    }
+
+    download_hash_free(h);
+}
+
+void
+download_hash_failed(WebKitDownload *download, GError *err, gpointer data)
+{
+    struct DownloadHash *h = (struct DownloadHash *)data;
+
+    h->failed = TRUE;
+    if (!h->busy)
+        download_hash_free(h);
+}
+
+void
+download_hash_finished(WebKitDownload *download, gpointer data)
+{
+    struct DownloadHash *h = (struct DownloadHash *)data;
+
+    h->finished = TRUE;
+    if (!h->busy)
+        download_hash_run(h);
+}
+
+void
+download_hash_free(gpointer data)
+{
+    struct DownloadHash *h = (struct DownloadHash *)data;
+
+    g_signal_handlers_disconnect_by_data(h->download, h);
+    g_object_unref(h->download);
+    g_object_unref(h->tb);
+
+    if (h->fd != -1)
+        close(h->fd);
+    g_checksum_free(h->checksum);
+    g_free(h->path);
+    g_free(h);
+    alloc_count(ALLOC_DOWNLOAD_HASH, -1);
+}
+
+void
+download_hash_progress(GObject *obj, GParamSpec *pspec, gpointer data)
+{
+    struct DownloadHash *h = (struct DownloadHash *)data;
+
+    if (!h->busy && !h->finished)
+        download_hash_run(h);
+}
+
+void
+download_hash_run(gpointer data)
+{
+    struct DownloadHash *h = (struct DownloadHash *)data;
+    GTask *task;
+
+    h->busy = TRUE;
+    h->final = h->finished;
+
+    task = g_task_new(NULL, NULL, download_hash_done, h);
+    g_task_set_task_data(task, h, NULL);
+    g_task_run_in_thread(task, download_hash_thread);
+    g_object_unref(task);
+}
+
+void
+download_hash_thread(GTask *task, gpointer source, gpointer task_data,
+                     GCancellable *cancellable)
+{
+    struct DownloadHash *h = (struct DownloadHash *)task_data;
+    guchar buf[65536];
+    gchar *partial;
+    struct stat st_fd, st_path;
+    ssize_t n;
+
+    /* Only this thread touches the checksum while h->busy is set. WebKit
+     * appends to the file, so everything up to its current end has been
+     * written and can be hashed right away.
+     *
+     * Until the download has finished, WebKit writes to a temporary file
+     * next to the destination and renames it afterwards. The descriptor
+     * stays valid across the rename, so the final run only reads what
+     * has been written since the last one. */
+    if (h->fd == -1 && !h->final)
+    {
+        partial = g_strdup_printf("%s.wkdownload", h->path);
+        h->fd = open(partial, O_RDONLY);
+        g_free(partial);
+    }
+    if (h->fd == -1)
+        h->fd = open(h->path, O_RDONLY);
+
+    /* Should we have read some other file after all, start over. */
+    if (h->fd != -1 && h->final &&
+        (fstat(h->fd, &st_fd) == -1 || stat(h->path, &st_path) == -1 ||
+         st_fd.st_dev != st_path.st_dev || st_fd.st_ino != st_path.st_ino))
+    {
+        close(h->fd);
+        h->fd = open(h->path, O_RDONLY);
+        g_checksum_reset(h->checksum);
+        h->hashed = 0;
+    }
+
+    if (h->fd != -1)
+    {
+        while ((n = pread(h->fd, buf, sizeof buf, h->hashed)) > 0)
+        {
+            g_checksum_update(h->checksum, buf, n);
+            h->hashed += n;
+        }
+    }
+
+    g_task_return_boolean(task, TRUE);
+}
+
+void
+downloadmanager_cancel(GtkToolButton *tb, gpointer data)
+{
+    WebKitDownload *download = WEBKIT_DOWNLOAD(data);
+
+    webkit_download_cancel(download);
+    gtk_widget_destroy(GTK_WIDGET(tb));
+}
+
+gboolean
+downloadmanager_delete(GtkWidget *obj, gpointer data)
+{
+    if (!quit_if_nothing_active())
+        gtk_widget_hide(dm.win);
+
+    return TRUE;
+}
+
+void
+downloadmanager_item_free(gpointer data)
+{
+    g_object_unref(data);
+    alloc_count(ALLOC_DOWNLOAD, -1);
+}
+
+void
+downloadmanager_setup(void)
+{
+    dm.win = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+    gtk_window_set_type_hint(GTK_WINDOW(dm.win), GDK_WINDOW_TYPE_HINT_DIALOG);
+    gtk_window_set_default_size(GTK_WINDOW(dm.win), 500, 250);
+    gtk_window_set_title(GTK_WINDOW(dm.win), __NAME__" - Download Manager");
+    watched_signal_connect(G_OBJECT(dm.win), "delete-event",
+                           downloadmanager_delete, NULL);
+    watched_signal_connect(G_OBJECT(dm.win), "key-press-event",
+                           key_downloadmanager, NULL);
+
+    dm.toolbar = gtk_toolbar_new();
+    gtk_orientable_set_orientation(GTK_ORIENTABLE(dm.toolbar),
+                                   GTK_ORIENTATION_VERTICAL);
+    gtk_toolbar_set_style(GTK_TOOLBAR(dm.toolbar), GTK_TOOLBAR_BOTH_HORIZ);
+    gtk_toolbar_set_show_arrow(GTK_TOOLBAR(dm.toolbar), FALSE);
+
+    dm.scroll = gtk_scrolled_window_new(NULL, NULL);
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(dm.scroll),
+                                   GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+    gtk_container_add(GTK_CONTAINER(dm.scroll), dm.toolbar);
+
+    gtk_container_add(GTK_CONTAINER(dm.win), dm.scroll);
+}
+
+void
+downloadmanager_trim(void)
+{
+    GList *items, *it;
+    gpointer download;
+
+    /* New rows are inserted at the top. Beyond the most recent ones,
+     * rows of finished downloads are removed. */
+    items = gtk_container_get_children(GTK_CONTAINER(dm.toolbar));
+    for (it = g_list_nth(items, downloadmanager_keep); it != NULL;
+         it = g_list_next(it))
+    {
+        download = g_object_get_data(G_OBJECT(it->data), __NAME__"-download");
+        if (download != NULL &&
+            g_object_get_data(G_OBJECT(download), __NAME__"-finished") != NULL)
+            gtk_widget_destroy(GTK_WIDGET(it->data));
+    }
+    g_list_free(items);
+}
+
+gchar *
+ensure_uri_scheme(const gchar *t)
+{
+    gchar *f, *fabs;
+
+    /* This is the blocking variant. It's only meant for places where
+     * there is no UI to freeze, i.e. when sending URIs to another
+     * instance. Use uri_load() everywhere else. */
+
+    f = uri_classify_lexical(t);
+    if (f == NULL)
+    {
+        fabs = realpath(t, NULL);
+        if (fabs != NULL)
+        {
+            f = g_strdup_printf("file://%s", fabs);
+            free(fabs);
+        }
+        else
+            f = g_strdup_printf("http://%s", t);
+    }
+    return f;
+}
+
+void
+external_handler_run(GtkAction *action, gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+    gchar *argv[] = { "lariza-external-handler", "-u", NULL, NULL };
+    GPid pid;
+    GError *err = NULL;
+
+    (void)action;
+
+    argv[2] = c->external_handler_uri;
+    if (!g_spawn_async(NULL, argv, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL,
+                       &pid, &err))
+    {
+        fprintf(stderr, __NAME__": Could not launch key handler: %s\n",
+                err->message);
+        g_error_free(err);
+    }
+    else
+        g_spawn_close_pid(pid);
+}
+
+void
+frame_after_paint(GdkFrameClock *clock, gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+    gint64 now, interval, refresh = 0;
+
+    /* Only frames in a row tell how fast we render. A long gap means
+     * nothing was drawn in between. */
+    now = gdk_frame_clock_get_frame_time(clock);
+    interval = now - c->frame_last;
+    c->frame_last = now;
+    if (interval > 250000)
+        return;
+
+    gdk_frame_clock_get_refresh_info(clock, 0, &refresh, NULL);
+    if (refresh > 0 && interval > refresh * 3 / 2)
+        c->frame_slow++;
+
+    c->frame_count++;
+    c->frame_max_us = MAX(c->frame_max_us, interval);
+    c->frame_total_us += interval;
+}
+
+void
+frame_realize(GtkWidget *widget, gpointer data)
+{
+    watched_signal_connect(G_OBJECT(gtk_widget_get_frame_clock(widget)),
+                           "after-paint", frame_after_paint, data);
+}
+
+void
+frame_unrealize(GtkWidget *widget, gpointer data)
+{
+    g_signal_handlers_disconnect_by_func(G_OBJECT(gtk_widget_get_frame_clock(widget)),
+                                         frame_after_paint, data);
+}
+
+void
+grab_environment_configuration(void)
+{
+    const gchar *e;
+    gsize i;
+
+    e = g_getenv(__NAME_UPPERCASE__"_ACCEPTED_LANGUAGE");
+    if (e != NULL)
+        accepted_language[0] = g_strdup(e);
+
+    e = g_getenv(__NAME_UPPERCASE__"_BACKGROUND_OPEN");
+    if (e != NULL)
+        background_open = TRUE;
+
+    e = g_getenv(__NAME_UPPERCASE__"_BATCH_FORMAT");
+    if (e != NULL)
+        batch_pdf = strcmp(e, "pdf") == 0;
+
+    e = g_getenv(__NAME_UPPERCASE__"_BATCH_JOBS");
+    if (e != NULL)
+        batch_jobs = MAX(atoi(e), 1);
+
+    e = g_getenv(__NAME_UPPERCASE__"_BATCH_TIMEOUT");
+    if (e != NULL)
+        batch_timeout = MAX(atoi(e), 1);
+
+    e = g_getenv(__NAME_UPPERCASE__"_CACHE_DIR");
+    if (e != NULL)
+        cache_dir = g_strdup(e);
+
+    e = g_getenv(__NAME_UPPERCASE__"_CACHE_EPHEMERAL");
+    if (e != NULL)
+        cache_ephemeral = TRUE;
+
+    e = g_getenv(__NAME_UPPERCASE__"_CACHE_MODEL");
+    if (e != NULL)
+    {
+        if (strcmp(e, "document-viewer") == 0)
+            cache_model = WEBKIT_CACHE_MODEL_DOCUMENT_VIEWER;
+        else if (strcmp(e, "document-browser") == 0)
+            cache_model = WEBKIT_CACHE_MODEL_DOCUMENT_BROWSER;
+        else if (strcmp(e, "web-browser") == 0)
+            cache_model = WEBKIT_CACHE_MODEL_WEB_BROWSER;
+        else
+            fprintf(stderr, __NAME__": Unknown cache model '%s'\n", e);
+    }
+
+    e = g_getenv(__NAME_UPPERCASE__"_CACHE_SIZE");
+    if (e != NULL)
+        cache_size_max = g_ascii_strtoull(e, NULL, 10) * 1000 * 1000;
+
+    e = g_getenv(__NAME_UPPERCASE__"_CRASH_RETRIES");
+    if (e != NULL)
+        crash_retries = atoi(e);
+
+    e = g_getenv(__NAME_UPPERCASE__"_DOWNLOAD_DIR");
+    if (e != NULL)
+        download_dir = g_strdup(e);
+
+    e = g_getenv(__NAME_UPPERCASE__"_DOWNLOAD_SIDECAR");
+    if (e != NULL)
+        download_sidecar = TRUE;
+
+    e = g_getenv(__NAME_UPPERCASE__"_ENABLE_EXPERIMENTAL_WEBGL");
+    if (e != NULL)
+        enable_webgl = TRUE;
+
+    e = g_getenv(__NAME_UPPERCASE__"_ENABLE_HOVER_PREFETCH");
+    if (e != NULL)
+        prefetch_enabled = TRUE;
+
+    e = g_getenv(__NAME_UPPERCASE__"_FIFO_SUFFIX");
+    if (e != NULL)
+        fifo_suffix = g_strdup(e);
+
+    e = g_getenv(__NAME_UPPERCASE__"_FRAME_STATS");
+    if (e != NULL)
+        frame_stats = TRUE;
+
+    e = g_getenv(__NAME_UPPERCASE__"_HISTORY_FILE");
+    if (e != NULL)
+        history_file = g_strdup(e);
+
+    e = g_getenv(__NAME_UPPERCASE__"_HOME_URI");
+    if (e != NULL)
+        home_uri = g_strdup(e);
+
+    e = g_getenv(__NAME_UPPERCASE__"_LOAD_LIMIT");
+    if (e != NULL)
+        load_limit = atoi(e);
+
+    e = g_getenv(__NAME_UPPERCASE__"_MEMORY_INTERVAL");
+    if (e != NULL)
+        memory_interval = atoi(e);
+
+    e = g_getenv(__NAME_UPPERCASE__"_METRICS_FILE");
+    if (e != NULL)
+        metrics_file = g_strdup(e);
+
+    e = g_getenv(__NAME_UPPERCASE__"_PAGE_CACHE_BUDGET");
+    if (e != NULL)
+        pagecache_budget_kb = (guint64)atoi(e) * 1024;
+
+    e = g_getenv(__NAME_UPPERCASE__"_PRELOAD");
+    if (e != NULL)
+    {
+        if (strcmp(e, "dns") == 0)
+            preload_dns = TRUE;
+        else if (strcmp(e, "prerender") == 0)
+            preload_dns = preload_prerender = TRUE;
+        else
+            fprintf(stderr, __NAME__": Unknown preload mode '%s'\n", e);
+    }
+
+    e = g_getenv(__NAME_UPPERCASE__"_PROCESS_MODEL");
+    if (e != NULL)
+    {
+        if (strcmp(e, "shared") == 0)
+            process_shared = TRUE;
+        else if (strcmp(e, "site") == 0)
+            process_per_site = TRUE;
+        else if (strcmp(e, "window") != 0)
+            fprintf(stderr, __NAME__": Unknown process model '%s'\n", e);
+    }
+
+    e = g_getenv(__NAME_UPPERCASE__"_RENDERING_PROFILE");
+    if (e != NULL)
+    {
+        for (i = 0; i < G_N_ELEMENTS(rendering_profiles); i++)
+            if (strcmp(e, rendering_profiles[i].name) == 0)
+                rendering_profile = &rendering_profiles[i];
+        if (rendering_profile == NULL)
+            fprintf(stderr, __NAME__": Unknown rendering profile '%s'\n", e);
+    }
+
+    e = g_getenv(__NAME_UPPERCASE__"_TRACE_FILE");
+    if (e != NULL)
+        trace_file = g_strdup(e);
+
+    e = g_getenv(__NAME_UPPERCASE__"_USER_AGENT");
+    if (e != NULL)
+        user_agent = g_strdup(e);
+
+    e = g_getenv(__NAME_UPPERCASE__"_WATCHDOG");
+    if (e != NULL)
+        watchdog_threshold_us = MAX(atoi(e), 1) * 1000;
+
+    e = g_getenv(__NAME_UPPERCASE__"_WEB_PROCESS_LIMIT");
+    if (e != NULL)
+        process_limit = atoi(e);
+
+    e = g_getenv(__NAME_UPPERCASE__"_ZOOM");
+    if (e != NULL)
+        global_zoom = atof(e);
+}
+
+void
+hover_web_view(WebKitWebView *web_view, WebKitHitTestResult *ht, guint modifiers,
+               gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+    const gchar *t;
+
+    if (!gtk_widget_is_focus(c->location))
+    {
+        if (webkit_hit_test_result_context_is_link(ht))
+        {
+            t = webkit_hit_test_result_get_link_uri(ht);
+            ui_queue_location(c, t);
+
+            /* This signal fires on every pointer movement, so only
+             * copy the URI if we're actually hovering a new link. */
+            if (g_strcmp0(c->hover_uri, t) != 0)
+            {
+                g_free(c->hover_uri);
+                c->hover_uri = g_strdup(t);
+                prefetch_schedule(c);
+            }
+        }
+        else
+        {
+            ui_queue_location(c, webkit_web_view_get_uri(
+                                 WEBKIT_WEB_VIEW(c->web_view)));
+
+            if (c->hover_uri != NULL)
+                g_free(c->hover_uri);
+            c->hover_uri = NULL;
+            prefetch_schedule(c);
+        }
+    }
+}
+
+gboolean
+key_common(GtkWidget *widget, GdkEvent *event, gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+
+    if (event->type == GDK_KEY_PRESS)
+    {
+        if (((GdkEventKey *)event)->state & GDK_MOD1_MASK)
+        {
+            switch (((GdkEventKey *)event)->keyval)
+            {
+                case GDK_KEY_q:  /* close window (left hand) */
+                    gtk_widget_destroy(c->win);
+                    return TRUE;
+                case GDK_KEY_w:  /* home (left hand) */
+                    load_request(c, home_uri);
+                    return TRUE;
+                case GDK_KEY_e:  /* new tab (left hand) */
+                    client_new(home_uri, NULL, TRUE, FALSE);
                     return TRUE;
                 case GDK_KEY_r:  /* reload (left hand) */
                     webkit_web_view_reload_bypass_cache(WEBKIT_WEB_VIEW(
@@ -690,168 +2485,1184 @@ key_common(GtkWidget *widget, GdkEvent *event, gpointer data)
                 case GDK_KEY_l:  /* location (BOTH hands) */
                     gtk_widget_grab_focus(c->location);
                     return TRUE;
-                case GDK_KEY_k:  /* initiate search (BOTH hands) */
+                case GDK_KEY_k:  /* initiate search (BOTH hands) */
+                    gtk_widget_grab_focus(c->location);
+                    ui_queue_location(c, NULL);
+                    gtk_entry_set_text(GTK_ENTRY(c->location), ":/");
+                    gtk_editable_set_position(GTK_EDITABLE(c->location), -1);
+                    return TRUE;
+                case GDK_KEY_c:  /* reload trusted certs (left hand) */
+                    trust_user_certs(webkit_web_view_get_context(
+                                     WEBKIT_WEB_VIEW(c->web_view)));
+                    return TRUE;
+                case GDK_KEY_x:  /* launch external handler (left hand) */
+                    if (c->external_handler_uri != NULL)
+                        g_free(c->external_handler_uri);
+                    c->external_handler_uri = g_strdup(
+                        webkit_web_view_get_uri(WEBKIT_WEB_VIEW(c->web_view)));
+                    external_handler_run(NULL, c);
+                    return TRUE;
+            }
+        }
+        /* navigate backward (left hand) */
+        else if (((GdkEventKey *)event)->keyval == GDK_KEY_F2)
+        {
+            pagecache_go(c, -1);
+            return TRUE;
+        }
+        /* navigate forward (left hand) */
+        else if (((GdkEventKey *)event)->keyval == GDK_KEY_F3)
+        {
+            pagecache_go(c, 1);
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+gboolean
+key_downloadmanager(GtkWidget *widget, GdkEvent *event, gpointer data)
+{
+    if (event->type == GDK_KEY_PRESS)
+    {
+        if (((GdkEventKey *)event)->state & GDK_MOD1_MASK)
+        {
+            switch (((GdkEventKey *)event)->keyval)
+            {
+                case GDK_KEY_d:  /* close window (left hand) */
+                case GDK_KEY_q:
+                    downloadmanager_delete(dm.win, NULL);
+                    return TRUE;
+            }
+        }
+    }
+
+    return FALSE;
+}
+
+gboolean
+key_location(GtkWidget *widget, GdkEvent *event, gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+    const gchar *t;
+
+    if (key_common(widget, event, data))
+        return TRUE;
+
+    if (event->type == GDK_KEY_PRESS)
+    {
+        switch (((GdkEventKey *)event)->keyval)
+        {
+            case GDK_KEY_KP_Enter:
+            case GDK_KEY_Return:
+                gtk_widget_grab_focus(c->web_view);
+                t = gtk_entry_get_text(GTK_ENTRY(c->location));
+                if (t != NULL && t[0] == ':' && t[1] == '/')
+                {
+                    if (c->search_timer != 0)
+                    {
+                        g_source_remove(c->search_timer);
+                        c->search_timer = 0;
+                    }
+
+                    /* Don't start over if the incremental search
+                     * already did this. */
+                    if (c->search_limit == 0 || g_strcmp0(search_text, t + 2) != 0)
+                    {
+                        if (search_text != NULL)
+                            g_free(search_text);
+                        search_text = g_strdup(t + 2);  /* XXX whacky */
+                        search(c, 0);
+                    }
+                }
+                else if (t != NULL && t[0] == ':' && command_run(c, t + 1))
                     gtk_widget_grab_focus(c->location);
-                    gtk_entry_set_text(GTK_ENTRY(c->location), ":/");
-                    gtk_editable_set_position(GTK_EDITABLE(c->location), -1);
-                    return TRUE;
-                case GDK_KEY_c:  /* reload trusted certs (left hand) */
-                    trust_user_certs(wc);
-                    return TRUE;
-                case GDK_KEY_x:  /* launch external handler (left hand) */
-                    if (c->external_handler_uri != NULL)
-                        g_free(c->external_handler_uri);
-                    c->external_handler_uri = g_strdup(
-                        webkit_web_view_get_uri(WEBKIT_WEB_VIEW(c->web_view)));
-                    external_handler_run(NULL, c);
+                else if (!preload_swap(c, t) &&
+                         !keywords_try_search(WEBKIT_WEB_VIEW(c->web_view), t))
+                    load_request(c, t);
+                return TRUE;
+            case GDK_KEY_Escape:
+                preload_discard(c);
+                t = webkit_web_view_get_uri(WEBKIT_WEB_VIEW(c->web_view));
+                ui_queue_location(c, NULL);
+                gtk_entry_set_text(GTK_ENTRY(c->location),
+                                   (t == NULL ? __NAME__ : t));
+                return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+gboolean
+key_web_view(GtkWidget *widget, GdkEvent *event, gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+    gdouble dx, dy;
+    gfloat z;
+
+    if (key_common(widget, event, data))
+        return TRUE;
+
+    if (event->type == GDK_KEY_PRESS)
+    {
+        if (((GdkEventKey *)event)->keyval == GDK_KEY_Escape)
+        {
+            webkit_web_view_stop_loading(WEBKIT_WEB_VIEW(c->web_view));
+            ui_queue_progress(c, 0);
+        }
+    }
+    else if (event->type == GDK_BUTTON_PRESS)
+    {
+        switch (((GdkEventButton *)event)->button)
+        {
+            case 2:
+                if (c->hover_uri != NULL)
+                {
+                    client_new(c->hover_uri, NULL, TRUE, background_open);
                     return TRUE;
+                }
+                break;
+            case 8:
+                pagecache_go(c, -1);
+                return TRUE;
+            case 9:
+                pagecache_go(c, 1);
+                return TRUE;
+        }
+    }
+    else if (event->type == GDK_SCROLL)
+    {
+        if (((GdkEventScroll *)event)->state & GDK_MOD1_MASK ||
+            ((GdkEventScroll *)event)->state & GDK_CONTROL_MASK)
+        {
+            gdk_event_get_scroll_deltas(event, &dx, &dy);
+            z = webkit_web_view_get_zoom_level(WEBKIT_WEB_VIEW(c->web_view));
+            z += -dy * 0.1;
+            z = dx != 0 ? global_zoom : z;
+            webkit_web_view_set_zoom_level(WEBKIT_WEB_VIEW(c->web_view), z);
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+gchar *
+keywords_expand(const gchar *t)
+{
+    gchar **tokens = NULL;
+    gchar *val = NULL, *escaped = NULL, *uri = NULL;
+
+    tokens = g_strsplit(t, " ", 2);
+    if (tokens[0] != NULL && tokens[1] != NULL)
+    {
+        val = g_hash_table_lookup(keywords, tokens[0]);
+        if (val != NULL)
+        {
+            escaped = g_uri_escape_string(tokens[1], NULL, TRUE);
+            uri = g_strdup_printf((gchar *)val, escaped);
+            g_free(escaped);
+        }
+    }
+    g_strfreev(tokens);
+
+    return uri;
+}
+
+void
+keywords_load(void)
+{
+    GError *err = NULL;
+    GIOChannel *channel = NULL;
+    gchar *path = NULL, *buf = NULL;
+    gchar **tokens = NULL;
+
+    keywords = g_hash_table_new(g_str_hash, g_str_equal);
+
+    path = g_build_filename(g_get_user_config_dir(), __NAME__, "keywordsearch",
+                            NULL);
+    channel = g_io_channel_new_file(path, "r", &err);
+    if (channel != NULL)
+    {
+        while (g_io_channel_read_line(channel, &buf, NULL, NULL, NULL)
+               == G_IO_STATUS_NORMAL)
+        {
+            g_strstrip(buf);
+            if (buf[0] != '#')
+            {
+                tokens = g_strsplit(buf, " ", 2);
+                if (tokens[0] != NULL && tokens[1] != NULL)
+                    g_hash_table_insert(keywords, g_strdup(tokens[0]),
+                                        g_strdup(tokens[1]));
+                g_strfreev(tokens);
+            }
+            g_free(buf);
+        }
+        g_io_channel_shutdown(channel, FALSE, NULL);
+    }
+    g_free(path);
+}
+
+gboolean
+keywords_try_search(WebKitWebView *web_view, const gchar *t)
+{
+    gchar *uri;
+
+    uri = keywords_expand(t);
+    if (uri == NULL)
+        return FALSE;
+
+    webkit_web_view_load_uri(web_view, uri);
+    g_free(uri);
+
+    return TRUE;
+}
+
+gboolean
+load_blocked(WebKitWebView *web_view)
+{
+    const gchar *uri;
+
+    /* Load events are only emitted for the main frame, so this is the
+     * URI of a document. */
+    uri = webkit_web_view_get_uri(web_view);
+    if (uri == NULL || !adblock_match(uri, NULL, ADBLOCK_DOCUMENT))
+        return FALSE;
+
+    trace_event('i', "adblock", "blocked", NULL, uri);
+    fprintf(stderr, __NAME__": Blocked '%s'\n", uri);
+    webkit_web_view_stop_loading(web_view);
+
+    return TRUE;
+}
+
+gboolean
+load_focus(GtkWidget *widget, GdkEvent *event, gpointer data)
+{
+    /* The window the user looks at doesn't wait for a slot. */
+    load_start(data);
+    return FALSE;
+}
+
+gboolean
+load_next(gpointer data)
+{
+    struct Client *c, *next;
+    GList *it;
+
+    load_idle = 0;
+
+    while (load_limit == 0 || load_active < load_limit)
+    {
+        /* The focused window goes first. Otherwise, start with the
+         * oldest client, new clients are prepended. */
+        next = NULL;
+        for (it = client_list; it != NULL; it = g_list_next(it))
+        {
+            c = (struct Client *)it->data;
+            if (c->load_queued == NULL)
+                continue;
+
+            next = c;
+            if (gtk_window_is_active(GTK_WINDOW(c->win)))
+                break;
+        }
+
+        if (next == NULL)
+            break;
+        load_start(next);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+void
+load_release(gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+
+    if (c->load_timer != 0)
+    {
+        g_source_remove(c->load_timer);
+        c->load_timer = 0;
+    }
+
+    if (c->load_slot)
+    {
+        c->load_slot = FALSE;
+        load_active--;
+
+        if (load_idle == 0)
+            load_idle = g_idle_add(load_next, NULL);
+    }
+}
+
+void
+load_request(gpointer data, const gchar *uri)
+{
+    struct Client *c = (struct Client *)data;
+    gboolean queued = c->load_queued != NULL;
+
+    g_free(c->load_queued);
+    c->load_queued = g_strdup(uri);
+
+    if (load_limit == 0 || load_active < load_limit ||
+        gtk_window_is_active(GTK_WINDOW(c->win)))
+    {
+        load_start(c);
+    }
+    else if (!queued)
+    {
+        gtk_entry_set_text(GTK_ENTRY(c->location), uri);
+        watched_signal_connect(G_OBJECT(c->win), "focus-in-event",
+                               load_focus, c);
+    }
+}
+
+gboolean
+load_stalled(gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+
+    /* The load never started, e.g. because it turned into a download
+     * or was rejected by decide_policy(). Don't keep the slot forever. */
+    c->load_timer = 0;
+    load_release(c);
+
+    return G_SOURCE_REMOVE;
+}
+
+void
+load_start(gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+    gchar *uri;
+
+    if (c->load_queued == NULL)
+        return;
+
+    g_signal_handlers_disconnect_by_func(G_OBJECT(c->win), load_focus, c);
+
+    /* WebKit reports WEBKIT_LOAD_STARTED asynchronously, so take the
+     * slot right now. Otherwise, a burst of requests would all see a
+     * free slot. */
+    if (!c->load_slot)
+    {
+        c->load_slot = TRUE;
+        load_active++;
+    }
+    if (c->load_timer == 0)
+        c->load_timer = g_timeout_add_seconds(load_stall_timeout,
+                                              load_stalled, c);
+
+    uri = c->load_queued;
+    c->load_queued = NULL;
+    uri_load(WEBKIT_WEB_VIEW(c->web_view), uri);
+    g_free(uri);
+}
+
+gint
+memory_cmp(gconstpointer a, gconstpointer b)
+{
+    const struct Client *ca = a, *cb = b;
+    guint64 ma, mb;
+
+    /* PSS is what a process would free on exit. It's not available on
+     * old kernels, though. */
+    ma = ca->memory_pss_kb != 0 ? ca->memory_pss_kb : ca->memory_rss_kb;
+    mb = cb->memory_pss_kb != 0 ? cb->memory_pss_kb : cb->memory_rss_kb;
+
+    return ma < mb ? 1 : (ma > mb ? -1 : 0);
+}
+
+void
+memory_dump(void)
+{
+    struct Client *c;
+    GList *sorted, *it;
+    const gchar *u;
+
+    fprintf(stderr, __NAME__": memory: %8s %10s %10s  %s\n", "pid", "rss_kib",
+            "pss_kib", "uri");
+    fprintf(stderr, __NAME__": memory: %8d %10"G_GUINT64_FORMAT" %10"
+            G_GUINT64_FORMAT"  (ui process)\n", memory_ui.pid,
+            memory_ui.rss_kb, memory_ui.pss_kb);
+
+    sorted = g_list_sort(g_list_copy(client_list), memory_cmp);
+    for (it = sorted; it != NULL; it = g_list_next(it))
+    {
+        c = (struct Client *)it->data;
+        u = webkit_web_view_get_uri(WEBKIT_WEB_VIEW(c->web_view));
+        fprintf(stderr, __NAME__": memory: %8d %10"G_GUINT64_FORMAT" %10"
+                G_GUINT64_FORMAT"  %s\n", c->memory_pid, c->memory_rss_kb,
+                c->memory_pss_kb, u == NULL ? "" : u);
+    }
+    g_list_free(sorted);
+}
+
+gboolean
+memory_sample(gpointer data)
+{
+    struct Client *c;
+    struct MemorySample s = { 0 };
+    GArray *samples;
+    GTask *task;
+    GList *it;
+    guint i;
+
+    /* Skip this round if the last one is still running. */
+    if (memory_sampling)
+        return G_SOURCE_CONTINUE;
+
+    samples = g_array_new(FALSE, TRUE, sizeof(struct MemorySample));
+    s.pid = (gint)getpid();
+    g_array_append_val(samples, s);
+    for (it = client_list; it != NULL; it = g_list_next(it))
+    {
+        c = (struct Client *)it->data;
+        if (c->memory_pid == 0)
+            continue;
+
+        for (i = 0; i < samples->len; i++)
+            if (g_array_index(samples, struct MemorySample, i).pid == c->memory_pid)
+                break;
+        if (i == samples->len)
+        {
+            s.pid = c->memory_pid;
+            g_array_append_val(samples, s);
+        }
+    }
+
+    memory_sampling = TRUE;
+    task = g_task_new(NULL, NULL, memory_sampled, NULL);
+    g_task_set_task_data(task, samples, (GDestroyNotify)g_array_unref);
+    g_task_run_in_thread(task, memory_sample_thread);
+    g_object_unref(task);
+
+    return G_SOURCE_CONTINUE;
+}
+
+void
+memory_sample_thread(GTask *task, gpointer source, gpointer task_data,
+                     GCancellable *cancellable)
+{
+    GArray *samples = (GArray *)task_data;
+    struct MemorySample *s;
+    gchar path[64], line[256];
+    guint64 v;
+    guint i;
+    FILE *fp;
+
+    /* Reading smaps_rollup can take a while for large processes, hence
+     * the thread. It exists since Linux 4.14, status is a fallback that
+     * only knows RSS. */
+    for (i = 0; i < samples->len; i++)
+    {
+        s = &g_array_index(samples, struct MemorySample, i);
+
+        g_snprintf(path, sizeof path, "/proc/%d/smaps_rollup", s->pid);
+        fp = fopen(path, "r");
+        if (fp == NULL)
+        {
+            g_snprintf(path, sizeof path, "/proc/%d/status", s->pid);
+            fp = fopen(path, "r");
+        }
+        if (fp == NULL)
+            continue;
+
+        while (fgets(line, sizeof line, fp) != NULL)
+        {
+            if (sscanf(line, "Rss: %"G_GUINT64_FORMAT, &v) == 1 ||
+                sscanf(line, "VmRSS: %"G_GUINT64_FORMAT, &v) == 1)
+                s->rss_kb = v;
+            else if (sscanf(line, "Pss: %"G_GUINT64_FORMAT, &v) == 1)
+                s->pss_kb = v;
+        }
+        fclose(fp);
+    }
+
+    g_task_return_boolean(task, TRUE);
+}
+
+void
+memory_sampled(GObject *obj, GAsyncResult *res, gpointer data)
+{
+    GArray *samples = g_task_get_task_data(G_TASK(res));
+    struct MemorySample *s;
+    struct Client *c;
+    guint64 total;
+    GList *it;
+    guint i;
+
+    memory_sampling = FALSE;
+    memory_ui = g_array_index(samples, struct MemorySample, 0);
+
+    for (i = 1, total = 0; i < samples->len; i++)
+    {
+        s = &g_array_index(samples, struct MemorySample, i);
+        total += s->pss_kb != 0 ? s->pss_kb : s->rss_kb;
+    }
+
+    /* The page cache is what grows when going back and forth. Pages
+     * that are open grow too, but there is nothing we can do about
+     * them. So the budget applies to growth since the cache has last
+     * been emptied or web processes came or went. */
+    if (pagecache_budget_kb > 0)
+    {
+        if (pagecache_baseline_kb == 0 ||
+            pagecache_baseline_processes != samples->len - 1)
+        {
+            pagecache_baseline_kb = total;
+            pagecache_baseline_processes = samples->len - 1;
+        }
+        pagecache_baseline_kb = MIN(pagecache_baseline_kb, total);
+        if (total > pagecache_baseline_kb + pagecache_budget_kb)
+        {
+            pagecache_evict();
+            pagecache_baseline_kb = 0;
+        }
+    }
+
+    for (it = client_list; it != NULL; it = g_list_next(it))
+    {
+        c = (struct Client *)it->data;
+        c->memory_pss_kb = 0;
+        c->memory_rss_kb = 0;
+
+        for (i = 1; i < samples->len; i++)
+        {
+            s = &g_array_index(samples, struct MemorySample, i);
+            if (s->pid == c->memory_pid)
+            {
+                c->memory_pss_kb = s->pss_kb;
+                c->memory_rss_kb = s->rss_kb;
+                break;
             }
         }
-        /* navigate backward (left hand) */
-        else if (((GdkEventKey *)event)->keyval == GDK_KEY_F2)
+    }
+}
+
+gboolean
+menu_web_view(WebKitWebView *web_view, WebKitContextMenu *menu, GdkEvent *ev,
+              WebKitHitTestResult *ht, gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+    WebKitContextMenuItem *mi = NULL;
+    const gchar *uri = NULL;
+
+    (void)ev;
+
+    if (webkit_hit_test_result_context_is_link(ht))
+        uri = webkit_hit_test_result_get_link_uri(ht);
+    else if (webkit_hit_test_result_context_is_image(ht))
+        uri = webkit_hit_test_result_get_image_uri(ht);
+    else if (webkit_hit_test_result_context_is_media(ht))
+        uri = webkit_hit_test_result_get_media_uri(ht);
+
+    if (uri != NULL)
+    {
+        webkit_context_menu_append(menu, webkit_context_menu_item_new_separator());
+
+        if (c->external_handler_uri != NULL)
+            g_free(c->external_handler_uri);
+        c->external_handler_uri = g_strdup(uri);
+
+        /* The menu item takes its own reference, one action per window
+         * is enough. */
+        if (c->external_handler_action == NULL)
         {
-            webkit_web_view_go_back(WEBKIT_WEB_VIEW(c->web_view));
-            return TRUE;
+            c->external_handler_action = gtk_action_new("external_handler",
+                                                        "Open with external handler",
+                                                        NULL, NULL);
+            watched_signal_connect(G_OBJECT(c->external_handler_action),
+                                   "activate", external_handler_run, c);
         }
-        /* navigate forward (left hand) */
-        else if (((GdkEventKey *)event)->keyval == GDK_KEY_F3)
+        mi = webkit_context_menu_item_new(c->external_handler_action);
+        webkit_context_menu_append(menu, mi);
+    }
+
+    /* FALSE = Show the menu. (TRUE = Don't ever show it.) */
+    return FALSE;
+}
+
+struct Client *
+metrics_client(guint64 id)
+{
+    struct Client *c;
+    GList *it;
+
+    for (it = client_list; it != NULL; it = g_list_next(it))
+    {
+        c = (struct Client *)it->data;
+        if (webkit_web_view_get_page_id(WEBKIT_WEB_VIEW(c->web_view)) == id)
+            return c;
+    }
+    return NULL;
+}
+
+gboolean
+metrics_msg(GIOChannel *channel, GIOCondition condition, gpointer data)
+{
+    struct Client *c;
+    gchar *line = NULL;
+    guint64 id;
+    guint requests, blocked;
+    gint64 match_us;
+    gint pid;
+
+    g_io_channel_read_line(channel, &line, NULL, NULL, NULL);
+    if (line)
+    {
+        if (sscanf(line, "%"G_GUINT64_FORMAT" %u %u %"G_GINT64_FORMAT,
+                   &id, &requests, &blocked, &match_us) == 4)
         {
-            webkit_web_view_go_forward(WEBKIT_WEB_VIEW(c->web_view));
-            return TRUE;
+            c = metrics_client(id);
+            if (c != NULL)
+            {
+                c->metrics_blocked += blocked;
+                c->metrics_match_us += match_us;
+                c->metrics_requests += requests;
+            }
+        }
+        else if (sscanf(line, "pid %"G_GUINT64_FORMAT" %d", &id, &pid) == 2)
+        {
+            /* Sent whenever a page is created in a web process, so this
+             * also follows process swaps. */
+            c = metrics_client(id);
+            if (c != NULL)
+                c->memory_pid = pid;
         }
+        g_free(line);
+    }
+    return TRUE;
+}
+
+void
+metrics_setup(void)
+{
+    GIOChannel *towatch;
+    gchar *fifofilename;
+
+    /* The web extension reports per-page counters through this pipe.
+     * Each instance has its own, so there is no need to tell apart
+     * multiple readers. */
+    fifofilename = g_strdup_printf("%s-%d", __NAME__".metrics", (int)getpid());
+    metrics_fifo = g_build_filename(g_get_user_runtime_dir(), fifofilename, NULL);
+    g_free(fifofilename);
+
+    unlink(metrics_fifo);
+    if (mkfifo(metrics_fifo, 0600) == -1)
+    {
+        perror(__NAME__": Could not create metrics FIFO");
+        g_free(metrics_fifo);
+        metrics_fifo = NULL;
+        return;
+    }
+
+    towatch = g_io_channel_new_file(metrics_fifo, "r+", NULL);
+    if (towatch == NULL)
+    {
+        fprintf(stderr, __NAME__": Can't open metrics FIFO.\n");
+        unlink(metrics_fifo);
+        g_free(metrics_fifo);
+        metrics_fifo = NULL;
+        return;
+    }
+    g_io_add_watch(towatch, G_IO_IN, (GIOFunc)metrics_msg, NULL);
+
+    webkit_web_context_set_web_extensions_initialization_user_data(
+        web_context, g_variant_new_string(metrics_fifo));
+}
+
+void
+metrics_write(gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+    FILE *fp;
+
+    if (metrics_file == NULL || c->metrics_uri == NULL ||
+        c->metrics_requests == 0)
+        return;
+
+    fp = fopen(metrics_file, "a");
+    if (fp != NULL)
+    {
+        fprintf(fp, "%s\t%u\t%u\t%.3f\n", c->metrics_uri, c->metrics_requests,
+                c->metrics_blocked, c->metrics_match_us / 1e3);
+        fclose(fp);
+    }
+    else
+        perror(__NAME__": Error opening metrics file");
+}
+
+gboolean
+pagecache_check(gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+
+    c->pagecache_timer = 0;
+    if (c->pagecache_pending &&
+        !webkit_web_view_is_loading(WEBKIT_WEB_VIEW(c->web_view)))
+        pagecache_reset(c);
+
+    return G_SOURCE_REMOVE;
+}
+
+void
+pagecache_evict(void)
+{
+    struct Client *c;
+    WebKitSettings *settings;
+    GList *it;
+
+    /* WebKit has no API to size the page cache. Turning it off drops
+     * all cached pages of a web process, so do that and turn it right
+     * back on. */
+    for (it = client_list; it != NULL; it = g_list_next(it))
+    {
+        c = (struct Client *)it->data;
+        settings = webkit_web_view_get_settings(WEBKIT_WEB_VIEW(c->web_view));
+        webkit_settings_set_enable_page_cache(settings, FALSE);
+        webkit_settings_set_enable_page_cache(settings, TRUE);
+    }
+    pagecache_evictions++;
+}
+
+void
+pagecache_go(gpointer data, gint direction)
+{
+    struct Client *c = (struct Client *)data;
+    WebKitWebView *wv = WEBKIT_WEB_VIEW(c->web_view);
+
+    if (direction < 0 ? !webkit_web_view_can_go_back(wv)
+                      : !webkit_web_view_can_go_forward(wv))
+        return;
+
+    /* A page restored from the page cache loads no resources at all.
+     * Watch for resource loads until this navigation has finished. The
+     * handler is gone after the first one, even if we're still
+     * waiting for the previous navigation. */
+    if (g_signal_handler_find(G_OBJECT(wv),
+                              G_SIGNAL_MATCH_FUNC | G_SIGNAL_MATCH_DATA,
+                              0, 0, NULL, pagecache_resource, c) == 0)
+        watched_signal_connect(G_OBJECT(wv), "resource-load-started",
+                               pagecache_resource, c);
+    c->pagecache_miss = FALSE;
+    c->pagecache_pending = TRUE;
+
+    if (direction < 0)
+        webkit_web_view_go_back(wv);
+    else
+        webkit_web_view_go_forward(wv);
+}
+
+gboolean
+pagecache_failed(WebKitWebView *web_view, WebKitLoadEvent load_event,
+                 gchar *failing_uri, GError *error, gpointer data)
+{
+    /* Neither a hit nor a miss. */
+    pagecache_reset(data);
+    return FALSE;
+}
+
+void
+pagecache_reset(gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+
+    if (!c->pagecache_pending)
+        return;
+
+    g_signal_handlers_disconnect_by_func(G_OBJECT(c->web_view),
+                                         pagecache_resource, c);
+    c->pagecache_pending = FALSE;
+}
+
+void
+pagecache_resource(WebKitWebView *web_view, WebKitWebResource *resource,
+                   WebKitURIRequest *request, gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+
+    c->pagecache_miss = TRUE;
+    g_signal_handlers_disconnect_by_func(G_OBJECT(web_view),
+                                         pagecache_resource, c);
+}
+
+gboolean
+prefetch_dwell(gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+
+    c->prefetch_timer = 0;
+
+    if (c->hover_uri != NULL)
+        prefetch_uri(webkit_web_view_get_context(WEBKIT_WEB_VIEW(c->web_view)),
+                     c->hover_uri);
+
+    return G_SOURCE_REMOVE;
+}
+
+void
+prefetch_schedule(gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+
+    if (!prefetch_enabled)
+        return;
+
+    /* Only resolve links the pointer actually rests on. */
+    if (c->prefetch_timer != 0)
+    {
+        g_source_remove(c->prefetch_timer);
+        c->prefetch_timer = 0;
+    }
+    if (c->hover_uri != NULL)
+        c->prefetch_timer = g_timeout_add(prefetch_dwell_ms, prefetch_dwell, c);
+}
+
+void
+prefetch_uri(WebKitWebContext *wc, const gchar *uri)
+{
+    gint64 now, *last;
+    gchar *host;
+
+    if (!g_str_has_prefix(uri, "http:") && !g_str_has_prefix(uri, "https:"))
+        return;
+
+    /* Nothing to resolve for IP addresses. */
+    host = uri_host(uri);
+    if (host == NULL || host[0] == 0 || host[0] == '[' ||
+        g_hostname_is_ip_address(host))
+    {
+        g_free(host);
+        return;
+    }
+
+    now = g_get_monotonic_time();
+
+    if (prefetch_hosts == NULL)
+        prefetch_hosts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                               g_free);
+    last = g_hash_table_lookup(prefetch_hosts, host);
+    if (last != NULL && now - *last < prefetch_host_ttl)
+    {
+        g_free(host);
+        return;
+    }
+
+    /* Don't let someone sweeping the pointer across a link farm turn
+     * us into a DNS flood. */
+    if (now - prefetch_rate_since >= G_USEC_PER_SEC)
+    {
+        prefetch_rate_since = now;
+        prefetch_rate = 0;
+    }
+    if (prefetch_rate >= prefetch_rate_max)
+    {
+        g_free(host);
+        return;
+    }
+    prefetch_rate++;
+
+    if (g_hash_table_size(prefetch_hosts) >= prefetch_hosts_max)
+        g_hash_table_remove_all(prefetch_hosts);
+    last = g_new(gint64, 1);
+    *last = now;
+    g_hash_table_replace(prefetch_hosts, g_strdup(host), last);
+
+    /* WebKit has no API to open a connection ahead of time, so warming
+     * up its DNS cache is as far as we can go. */
+    webkit_web_context_prefetch_dns(wc, host);
+    g_free(host);
+}
+
+void
+preload_changed(GtkEditable *editable, gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+
+    /* Only react to the user typing, not to us showing URIs. */
+    if (!preload_dns || !gtk_widget_is_focus(c->location))
+        return;
+
+    if (c->preload_timer != 0)
+        g_source_remove(c->preload_timer);
+    c->preload_timer = g_timeout_add(preload_debounce_ms, preload_typed, c);
+}
+
+void
+preload_discard(gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+
+    if (c->preload_timer != 0)
+    {
+        g_source_remove(c->preload_timer);
+        c->preload_timer = 0;
+    }
+
+    if (c->preload_view != NULL)
+    {
+        gtk_widget_destroy(c->preload_view);
+        g_object_unref(c->preload_view);
+        c->preload_view = NULL;
+    }
+
+    g_free(c->preload_uri);
+    c->preload_uri = NULL;
+}
+
+void
+preload_load_changed(WebKitWebView *web_view, WebKitLoadEvent load_event,
+                     gpointer data)
+{
+    if ((load_event == WEBKIT_LOAD_STARTED ||
+         load_event == WEBKIT_LOAD_REDIRECTED) && load_blocked(web_view))
+        g_object_set_data(G_OBJECT(web_view), __NAME__"-rejected",
+                          GINT_TO_POINTER(TRUE));
+}
+
+gboolean
+preload_policy(WebKitWebView *web_view, WebKitPolicyDecision *decision,
+               WebKitPolicyDecisionType type, gpointer data)
+{
+    switch (type)
+    {
+        case WEBKIT_POLICY_DECISION_TYPE_NEW_WINDOW_ACTION:
+            /* Nobody asked for popups. */
+            webkit_policy_decision_ignore(decision);
+            break;
+        case WEBKIT_POLICY_DECISION_TYPE_RESPONSE:
+            /* Nothing gets downloaded before the user confirms. */
+            if (webkit_response_policy_decision_is_mime_type_supported(
+                WEBKIT_RESPONSE_POLICY_DECISION(decision)))
+                return FALSE;
+            webkit_policy_decision_ignore(decision);
+            g_object_set_data(G_OBJECT(web_view), __NAME__"-rejected",
+                              GINT_TO_POINTER(TRUE));
+            break;
+        default:
+            return FALSE;
     }
+    return TRUE;
+}
 
-    return FALSE;
+gchar *
+preload_resolve(const gchar *t)
+{
+    gchar *uri;
+
+    /* Only guess when there's no doubt, i.e. without asking the file
+     * system like uri_load() might have to. */
+    if (t[0] == ':')
+        return NULL;
+
+    uri = keywords_expand(t);
+    if (uri == NULL)
+        uri = uri_classify_lexical(t);
+
+    if (uri != NULL && !g_str_has_prefix(uri, "http:") &&
+        !g_str_has_prefix(uri, "https:"))
+    {
+        g_free(uri);
+        uri = NULL;
+    }
+
+    return uri;
 }
 
 gboolean
-key_downloadmanager(GtkWidget *widget, GdkEvent *event, gpointer data)
+preload_swap(gpointer data, const gchar *t)
 {
-    if (event->type == GDK_KEY_PRESS)
+    struct Client *c = (struct Client *)data;
+    GtkWidget *old;
+    gchar *uri;
+    gboolean match;
+    gdouble zoom;
+
+    /* A regular load takes care of whatever the hidden view wasn't
+     * allowed to do. */
+    if (c->preload_view == NULL ||
+        g_object_get_data(G_OBJECT(c->preload_view), __NAME__"-rejected") != NULL)
     {
-        if (((GdkEventKey *)event)->state & GDK_MOD1_MASK)
-        {
-            switch (((GdkEventKey *)event)->keyval)
-            {
-                case GDK_KEY_d:  /* close window (left hand) */
-                case GDK_KEY_q:
-                    downloadmanager_delete(dm.win, NULL);
-                    return TRUE;
-            }
-        }
+        preload_discard(c);
+        return FALSE;
     }
 
-    return FALSE;
+    uri = preload_resolve(t);
+    match = uri != NULL && strcmp(uri, c->preload_uri) == 0;
+    g_free(uri);
+    if (!match)
+    {
+        preload_discard(c);
+        return FALSE;
+    }
+
+    /* Whatever the old view was up to ends here, as if the user had
+     * navigated away. */
+    load_release(c);
+    metrics_write(c);
+    c->metrics_blocked = 0;
+    c->metrics_match_us = 0;
+    c->metrics_requests = 0;
+    c->pagecache_pending = FALSE;
+    c->search_limit = 0;
+    search_status(c);
+    if (c->crash_timer != 0)
+    {
+        g_source_remove(c->crash_timer);
+        c->crash_timer = 0;
+    }
+    c->crash_at = 0;
+    c->crash_reloading = FALSE;
+
+    old = c->web_view;
+    zoom = webkit_web_view_get_zoom_level(WEBKIT_WEB_VIEW(old));
+    g_signal_handlers_disconnect_by_data(G_OBJECT(old), c);
+    gtk_widget_destroy(old);
+
+    c->web_view = c->preload_view;
+    c->preload_view = NULL;
+    g_free(c->preload_uri);
+    c->preload_uri = NULL;
+
+    /* The user may have zoomed this window. */
+    webkit_web_view_set_zoom_level(WEBKIT_WEB_VIEW(c->web_view), zoom);
+    g_signal_handlers_disconnect_by_data(G_OBJECT(c->web_view), c);
+    client_connect_web_view(c);
+    gtk_box_pack_start(GTK_BOX(c->vbox), c->web_view, TRUE, TRUE, 0);
+    g_object_unref(c->web_view);
+    gtk_widget_show(c->web_view);
+    gtk_widget_grab_focus(c->web_view);
+
+    /* Nobody was listening while the view was hidden. */
+    changed_uri(G_OBJECT(c->web_view), NULL, c);
+    changed_title(G_OBJECT(c->web_view), NULL, c);
+    changed_load_progress(G_OBJECT(c->web_view), NULL, c);
+
+    return TRUE;
 }
 
 gboolean
-key_location(GtkWidget *widget, GdkEvent *event, gpointer data)
+preload_typed(gpointer data)
 {
     struct Client *c = (struct Client *)data;
-    const gchar *t;
-    gchar *f;
+    gchar *uri;
 
-    if (key_common(widget, event, data))
-        return TRUE;
+    c->preload_timer = 0;
 
-    if (event->type == GDK_KEY_PRESS)
+    uri = preload_resolve(gtk_entry_get_text(GTK_ENTRY(c->location)));
+    if (uri == NULL)
     {
-        switch (((GdkEventKey *)event)->keyval)
-        {
-            case GDK_KEY_KP_Enter:
-            case GDK_KEY_Return:
-                gtk_widget_grab_focus(c->web_view);
-                t = gtk_entry_get_text(GTK_ENTRY(c->location));
-                if (t != NULL && t[0] == ':' && t[1] == '/')
-                {
-                    if (search_text != NULL)
-                        g_free(search_text);
-                    search_text = g_strdup(t + 2);  /* XXX whacky */
-                    search(c, 0);
-                }
-                else if (!keywords_try_search(WEBKIT_WEB_VIEW(c->web_view), t))
-                {
-                    f = ensure_uri_scheme(t);
-                    webkit_web_view_load_uri(WEBKIT_WEB_VIEW(c->web_view), f);
-                    g_free(f);
-                }
-                return TRUE;
-            case GDK_KEY_Escape:
-                t = webkit_web_view_get_uri(WEBKIT_WEB_VIEW(c->web_view));
-                gtk_entry_set_text(GTK_ENTRY(c->location),
-                                   (t == NULL ? __NAME__ : t));
-                return TRUE;
-        }
+        preload_discard(c);
+        return G_SOURCE_REMOVE;
     }
 
-    return FALSE;
+    if (g_strcmp0(uri, c->preload_uri) == 0)
+    {
+        g_free(uri);
+        return G_SOURCE_REMOVE;
+    }
+
+    preload_discard(c);
+    prefetch_uri(webkit_web_view_get_context(WEBKIT_WEB_VIEW(c->web_view)),
+                 uri);
+
+    if (preload_prerender)
+    {
+        /* A related view shares the process and settings of the window.
+         * It isn't shown until the user confirms with Return. */
+        c->preload_view = webkit_web_view_new_with_related_view(
+            WEBKIT_WEB_VIEW(c->web_view));
+        g_object_ref_sink(c->preload_view);
+        watched_signal_connect(G_OBJECT(c->preload_view), "decide-policy",
+                               preload_policy, c);
+        watched_signal_connect(G_OBJECT(c->preload_view), "load-changed",
+                               preload_load_changed, c);
+        webkit_web_view_load_uri(WEBKIT_WEB_VIEW(c->preload_view), uri);
+    }
+    c->preload_uri = uri;
+
+    return G_SOURCE_REMOVE;
 }
 
-gboolean
-key_web_view(GtkWidget *widget, GdkEvent *event, gpointer data)
+void
+profiles_apply(gpointer data, const gchar *uri)
 {
     struct Client *c = (struct Client *)data;
-    gdouble dx, dy;
-    gfloat z;
+    WebKitSettings *settings;
+    struct ProfileRule *r;
+    GValue v = G_VALUE_INIT;
+    GSList *it;
+    gchar *host;
 
-    if (key_common(widget, event, data))
-        return TRUE;
+    if (profile_rules == NULL)
+        return;
 
-    if (event->type == GDK_KEY_PRESS)
+    host = uri_host(uri);
+    if (host == NULL)
+        host = g_strdup("");
+
+    /* This is called for each change of the URI. Only do something
+     * when we navigate to another host. */
+    if (c->profile_host != NULL && strcmp(c->profile_host, host) == 0)
     {
-        if (((GdkEventKey *)event)->keyval == GDK_KEY_Escape)
-        {
-            webkit_web_view_stop_loading(WEBKIT_WEB_VIEW(c->web_view));
-            gtk_entry_set_progress_fraction(GTK_ENTRY(c->location), 0);
-        }
+        g_free(host);
+        return;
     }
-    else if (event->type == GDK_BUTTON_PRESS)
+
+    settings = webkit_web_view_get_settings(WEBKIT_WEB_VIEW(c->web_view));
+
+    /* Undo what the previous host changed, ... */
+    if (c->profile_host != NULL)
     {
-        switch (((GdkEventButton *)event)->button)
+        for (it = profile_rules; it != NULL; it = g_slist_next(it))
         {
-            case 2:
-                if (c->hover_uri != NULL)
-                {
-                    client_new(c->hover_uri, NULL, TRUE);
-                    return TRUE;
-                }
-                break;
-            case 8:
-                webkit_web_view_go_back(WEBKIT_WEB_VIEW(c->web_view));
-                return TRUE;
-            case 9:
-                webkit_web_view_go_forward(WEBKIT_WEB_VIEW(c->web_view));
-                return TRUE;
+            r = (struct ProfileRule *)it->data;
+            if (g_pattern_match_string(r->pattern, c->profile_host))
+            {
+                g_value_init(&v, G_PARAM_SPEC_VALUE_TYPE(r->pspec));
+                g_object_get_property(G_OBJECT(profile_defaults),
+                                      r->pspec->name, &v);
+                g_object_set_property(G_OBJECT(settings), r->pspec->name, &v);
+                g_value_unset(&v);
+            }
         }
     }
-    else if (event->type == GDK_SCROLL)
+
+    /* ... then apply all matching rules in order. Later rules win. */
+    for (it = profile_rules; it != NULL; it = g_slist_next(it))
     {
-        if (((GdkEventScroll *)event)->state & GDK_MOD1_MASK ||
-            ((GdkEventScroll *)event)->state & GDK_CONTROL_MASK)
-        {
-            gdk_event_get_scroll_deltas(event, &dx, &dy);
-            z = webkit_web_view_get_zoom_level(WEBKIT_WEB_VIEW(c->web_view));
-            z += -dy * 0.1;
-            z = dx != 0 ? global_zoom : z;
-            webkit_web_view_set_zoom_level(WEBKIT_WEB_VIEW(c->web_view), z);
-            return TRUE;
-        }
+        r = (struct ProfileRule *)it->data;
+        if (g_pattern_match_string(r->pattern, host))
+            g_object_set_property(G_OBJECT(settings), r->pspec->name, &r->value);
     }
 
-    return FALSE;
+    g_free(c->profile_host);
+    c->profile_host = host;
 }
 
 void
-keywords_load(void)
+profiles_load(void)
 {
     GError *err = NULL;
     GIOChannel *channel = NULL;
+    GObjectClass *klass;
+    GParamSpec *pspec;
+    GType type;
+    GEnumValue *ev;
+    struct ProfileRule *r;
     gchar *path = NULL, *buf = NULL;
     gchar **tokens = NULL;
+    gboolean ok;
 
-    keywords = g_hash_table_new(g_str_hash, g_str_equal);
+    profile_defaults = settings_new();
+    klass = G_OBJECT_GET_CLASS(profile_defaults);
 
-    path = g_build_filename(g_get_user_config_dir(), __NAME__, "keywordsearch",
+    path = g_build_filename(g_get_user_config_dir(), __NAME__, "profiles",
                             NULL);
     channel = g_io_channel_new_file(path, "r", &err);
     if (channel != NULL)
@@ -862,10 +3673,63 @@ keywords_load(void)
             g_strstrip(buf);
             if (buf[0] != '#')
             {
-                tokens = g_strsplit(buf, " ", 2);
-                if (tokens[0] != NULL && tokens[1] != NULL)
-                    g_hash_table_insert(keywords, g_strdup(tokens[0]),
-                                        g_strdup(tokens[1]));
+                tokens = g_strsplit(buf, " ", 3);
+                if (tokens[0] != NULL && tokens[1] != NULL && tokens[2] != NULL)
+                {
+                    pspec = g_object_class_find_property(klass, tokens[1]);
+                    if (pspec == NULL || !(pspec->flags & G_PARAM_WRITABLE))
+                    {
+                        fprintf(stderr, __NAME__": Unknown setting in profile: %s\n",
+                                tokens[1]);
+                        g_strfreev(tokens);
+                        g_free(buf);
+                        continue;
+                    }
+
+                    r = g_new0(struct ProfileRule, 1);
+                    r->pspec = pspec;
+                    type = G_PARAM_SPEC_VALUE_TYPE(pspec);
+                    g_value_init(&r->value, type);
+                    ok = TRUE;
+
+                    if (type == G_TYPE_BOOLEAN)
+                        g_value_set_boolean(&r->value,
+                                            strcmp(tokens[2], "true") == 0 ||
+                                            strcmp(tokens[2], "on") == 0 ||
+                                            strcmp(tokens[2], "1") == 0);
+                    else if (type == G_TYPE_STRING)
+                        g_value_set_string(&r->value, tokens[2]);
+                    else if (type == G_TYPE_UINT)
+                        g_value_set_uint(&r->value, strtoul(tokens[2], NULL, 10));
+                    else if (type == G_TYPE_INT)
+                        g_value_set_int(&r->value, atoi(tokens[2]));
+                    else if (type == G_TYPE_DOUBLE)
+                        g_value_set_double(&r->value, g_ascii_strtod(tokens[2], NULL));
+                    else if (G_TYPE_IS_ENUM(type))
+                    {
+                        ev = g_enum_get_value_by_nick(
+                            G_ENUM_CLASS(g_type_class_ref(type)), tokens[2]);
+                        if (ev != NULL)
+                            g_value_set_enum(&r->value, ev->value);
+                        else
+                            ok = FALSE;
+                    }
+                    else
+                        ok = FALSE;
+
+                    if (ok)
+                    {
+                        r->pattern = g_pattern_spec_new(tokens[0]);
+                        profile_rules = g_slist_prepend(profile_rules, r);
+                    }
+                    else
+                    {
+                        fprintf(stderr, __NAME__": Invalid value for %s: %s\n",
+                                tokens[1], tokens[2]);
+                        g_value_unset(&r->value);
+                        g_free(r);
+                    }
+                }
                 g_strfreev(tokens);
             }
             g_free(buf);
@@ -873,127 +3737,233 @@ keywords_load(void)
         g_io_channel_shutdown(channel, FALSE, NULL);
     }
     g_free(path);
+
+    profile_rules = g_slist_reverse(profile_rules);
 }
 
 gboolean
-keywords_try_search(WebKitWebView *web_view, const gchar *t)
+quit_if_nothing_active(void)
 {
-    gboolean ret = FALSE;
-    gchar **tokens = NULL;
-    gchar *val = NULL, *escaped = NULL, *uri = NULL;
-
-    tokens = g_strsplit(t, " ", 2);
-    if (tokens[0] != NULL && tokens[1] != NULL)
+    if (clients == 0)
     {
-        val = g_hash_table_lookup(keywords, tokens[0]);
-        if (val != NULL)
+        if (downloads == 0)
         {
-            escaped = g_uri_escape_string(tokens[1], NULL, TRUE);
-            uri = g_strdup_printf((gchar *)val, escaped);
-            webkit_web_view_load_uri(web_view, uri);
-            g_free(uri);
-            g_free(escaped);
-            ret = TRUE;
+            gtk_main_quit();
+            return TRUE;
         }
+        else
+            gtk_widget_show_all(dm.win);
     }
-    g_strfreev(tokens);
 
-    return ret;
+    return FALSE;
 }
 
 gboolean
-menu_web_view(WebKitWebView *web_view, WebKitContextMenu *menu, GdkEvent *ev,
-              WebKitHitTestResult *ht, gpointer data)
+remote_msg(GIOChannel *channel, GIOCondition condition, gpointer data)
 {
-    struct Client *c = (struct Client *)data;
-    GtkAction *action = NULL;
-    WebKitContextMenuItem *mi = NULL;
-    const gchar *uri = NULL;
+    gchar *uri = NULL;
 
-    (void)ev;
+    watchdog_enter("remote_msg", NULL);
+    g_io_channel_read_line(channel, &uri, NULL, NULL, NULL);
+    if (uri)
+    {
+        g_strstrip(uri);
+        trace_event('B', "fifo", "remote_msg", NULL, uri);
+        if (batch_dir != NULL)
+            batch_add(uri);
+        else
+            client_new(uri, NULL, TRUE, background_open);
+        trace_event('E', "fifo", "remote_msg", NULL, NULL);
+        g_free(uri);
+    }
+    watchdog_leave("remote_msg", NULL);
+    return TRUE;
+}
 
-    if (webkit_hit_test_result_context_is_link(ht))
-        uri = webkit_hit_test_result_get_link_uri(ht);
-    else if (webkit_hit_test_result_context_is_image(ht))
-        uri = webkit_hit_test_result_get_image_uri(ht);
-    else if (webkit_hit_test_result_context_is_media(ht))
-        uri = webkit_hit_test_result_get_media_uri(ht);
+void
+search(gpointer data, gint direction)
+{
+    struct Client *c = (struct Client *)data;
+    WebKitWebView *web_view = WEBKIT_WEB_VIEW(c->web_view);
+    WebKitFindController *fc = webkit_web_view_get_find_controller(web_view);
+    WebKitFindOptions opts = WEBKIT_FIND_OPTIONS_CASE_INSENSITIVE |
+                             WEBKIT_FIND_OPTIONS_WRAP_AROUND;
 
-    if (uri != NULL)
+    if (search_text == NULL)
+        return;
+
+    if (search_text[0] == 0)
     {
-        webkit_context_menu_append(menu, webkit_context_menu_item_new_separator());
+        webkit_find_controller_search_finish(fc);
+        c->search_limit = 0;
+        search_status(c);
+        return;
+    }
 
-        if (c->external_handler_uri != NULL)
-            g_free(c->external_handler_uri);
-        c->external_handler_uri = g_strdup(uri);
-        action = gtk_action_new("external_handler", "Open with external handler",
-                                NULL, NULL);
-        g_signal_connect(G_OBJECT(action), "activate",
-                         G_CALLBACK(external_handler_run), data);
-        mi = webkit_context_menu_item_new(action);
-        webkit_context_menu_append(menu, mi);
+    /* Nothing to repeat in this window yet. */
+    if (c->search_limit == 0)
+        direction = 0;
+
+    switch (direction)
+    {
+        case 0:
+            /* Counting and highlighting all matches on a huge page takes
+             * ages. Start with a few and count more when needed. */
+            c->search_count = 0;
+            c->search_index = 1;
+            c->search_limit = search_limit_initial;
+            webkit_find_controller_search(fc, search_text, opts,
+                                          c->search_limit);
+            break;
+        case 1:
+            webkit_find_controller_search_next(fc);
+            c->search_index++;
+            if (c->search_count != G_MAXUINT && c->search_index > c->search_count)
+                c->search_index = 1;
+            else if (c->search_count == G_MAXUINT &&
+                     c->search_index > c->search_limit)
+            {
+                c->search_limit = c->search_limit > G_MAXUINT / 10 ?
+                                  G_MAXUINT - 1 : c->search_limit * 10;
+                webkit_find_controller_count_matches(fc, search_text, opts,
+                                                     c->search_limit);
+            }
+            break;
+        case -1:
+            webkit_find_controller_search_previous(fc);
+            if (c->search_index > 1)
+                c->search_index--;
+            else if (c->search_count != G_MAXUINT)
+                c->search_index = c->search_count;
+            else
+            {
+                /* We wrapped around to the last match, so we need to
+                 * know how many there are, after all. */
+                c->search_index = 0;
+                c->search_limit = G_MAXUINT - 1;
+                webkit_find_controller_count_matches(fc, search_text, opts,
+                                                     c->search_limit);
+            }
+            break;
     }
 
-    /* FALSE = Show the menu. (TRUE = Don't ever show it.) */
-    return FALSE;
+    /* For new searches, WebKit tells us about the matches soon. */
+    if (direction != 0)
+        search_status(c);
+}
+
+void
+search_changed(GtkEditable *editable, gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+    const gchar *t;
+
+    /* Only react to the user typing, not to us showing URIs. */
+    if (!gtk_widget_is_focus(c->location))
+        return;
+
+    t = gtk_entry_get_text(GTK_ENTRY(c->location));
+    if (t[0] != ':' || t[1] != '/')
+        return;
+
+    if (c->search_timer != 0)
+        g_source_remove(c->search_timer);
+    c->search_timer = g_timeout_add(search_debounce_ms, search_debounced, c);
+}
+
+void
+search_counted(WebKitFindController *fc, guint match_count, gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+
+    /* WebKit reports G_MAXUINT if there are more matches than the
+     * limit we asked for. */
+    c->search_count = match_count;
+    if (c->search_index == 0 && match_count != G_MAXUINT)
+        c->search_index = match_count;
+    search_status(c);
 }
 
 gboolean
-quit_if_nothing_active(void)
+search_debounced(gpointer data)
 {
-    if (clients == 0)
+    struct Client *c = (struct Client *)data;
+    const gchar *t;
+
+    c->search_timer = 0;
+
+    t = gtk_entry_get_text(GTK_ENTRY(c->location));
+    if (t[0] == ':' && t[1] == '/')
     {
-        if (downloads == 0)
-        {
-            gtk_main_quit();
-            return TRUE;
-        }
-        else
-            gtk_widget_show_all(dm.win);
+        if (search_text != NULL)
+            g_free(search_text);
+        search_text = g_strdup(t + 2);
+        search(c, 0);
     }
 
-    return FALSE;
+    return G_SOURCE_REMOVE;
 }
 
-gboolean
-remote_msg(GIOChannel *channel, GIOCondition condition, gpointer data)
+void
+search_failed(WebKitFindController *fc, gpointer data)
 {
-    gchar *uri = NULL;
+    search_counted(fc, 0, data);
+}
 
-    g_io_channel_read_line(channel, &uri, NULL, NULL, NULL);
-    if (uri)
+void
+search_status(gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+    gchar *t;
+
+    if (c->search_limit == 0)
     {
-        g_strstrip(uri);
-        client_new(uri, NULL, TRUE);
-        g_free(uri);
+        gtk_widget_hide(c->search_label);
+        return;
     }
-    return TRUE;
+
+    if (c->search_count == 0)
+        t = g_strdup("No matches");
+    else if (c->search_count == G_MAXUINT)
+        t = g_strdup_printf("%u of %u+", c->search_index, c->search_limit);
+    else
+        t = g_strdup_printf("%u of %u", c->search_index, c->search_count);
+    gtk_label_set_text(GTK_LABEL(c->search_label), t);
+    g_free(t);
+
+    gtk_widget_show(c->search_label);
+}
+
+WebKitSettings *
+settings_new(void)
+{
+    WebKitSettings *settings;
+
+    settings = webkit_settings_new();
+    settings_setup(settings);
+
+    return settings;
 }
 
 void
-search(gpointer data, gint direction)
+settings_setup(WebKitSettings *settings)
 {
-    struct Client *c = (struct Client *)data;
-    WebKitWebView *web_view = WEBKIT_WEB_VIEW(c->web_view);
-    WebKitFindController *fc = webkit_web_view_get_find_controller(web_view);
+    if (user_agent != NULL)
+        g_object_set(G_OBJECT(settings), "user-agent", user_agent, NULL);
 
-    if (search_text == NULL)
-        return;
+    if (enable_webgl)
+        webkit_settings_set_enable_webgl(settings, TRUE);
 
-    switch (direction)
+    webkit_settings_set_enable_page_cache(settings, TRUE);
+
+    if (rendering_profile != NULL)
     {
-        case 0:
-            webkit_find_controller_search(fc, search_text,
-                                          WEBKIT_FIND_OPTIONS_CASE_INSENSITIVE |
-                                          WEBKIT_FIND_OPTIONS_WRAP_AROUND,
-                                          G_MAXUINT);
-            break;
-        case 1:
-            webkit_find_controller_search_next(fc);
-            break;
-        case -1:
-            webkit_find_controller_search_previous(fc);
-            break;
+        webkit_settings_set_hardware_acceleration_policy(settings,
+                                                         rendering_profile->policy);
+        webkit_settings_set_enable_smooth_scrolling(settings,
+            rendering_profile->smooth_scrolling);
+        webkit_settings_set_enable_accelerated_2d_canvas(settings,
+            rendering_profile->accelerated_2d_canvas);
     }
 }
 
@@ -1052,9 +4022,13 @@ void
 trust_user_certs(WebKitWebContext *wc)
 {
     GTlsCertificate *cert;
-    const gchar *basedir, *file, *absfile;
+    const gchar *file;
+    gchar *basedir, *absfile;
     GDir *dir;
 
+    watchdog_enter("trust_user_certs", NULL);
+    trace_event('B', "certs", "trust_user_certs", NULL, NULL);
+
     basedir = g_build_filename(g_get_user_config_dir(), __NAME__, "certs", NULL);
     dir = g_dir_open(basedir, 0, NULL);
     if (dir != NULL)
@@ -1068,30 +4042,532 @@ trust_user_certs(WebKitWebContext *wc)
             if (cert == NULL)
                 fprintf(stderr, __NAME__": Could not load trusted cert '%s'\n", file);
             else
+            {
                 webkit_web_context_allow_tls_certificate_for_host(wc, cert, file);
+                g_object_unref(cert);
+            }
+            g_free(absfile);
             file = g_dir_read_name(dir);
         }
         g_dir_close(dir);
     }
+    g_free(basedir);
+
+    trace_event('E', "certs", "trust_user_certs", NULL, NULL);
+    watchdog_leave("trust_user_certs", NULL);
+}
+
+void
+ui_queue_location(gpointer data, const gchar *t)
+{
+    struct Client *c = (struct Client *)data;
+    const gchar *cur;
+
+    /* NULL drops a pending update. This is used when the location bar
+     * is about to be written to directly, e.g. by the user. */
+    if (t == NULL)
+    {
+        g_free(c->ui_location);
+        c->ui_location = NULL;
+        return;
+    }
+
+    cur = c->ui_location;
+    if (cur == NULL)
+        cur = gtk_entry_get_text(GTK_ENTRY(c->location));
+    if (strcmp(cur, t) == 0)
+        return;
+
+    g_free(c->ui_location);
+    c->ui_location = g_strdup(t);
+    ui_schedule(c);
+}
+
+void
+ui_queue_progress(gpointer data, gdouble p)
+{
+    struct Client *c = (struct Client *)data;
+    gdouble cur;
+
+    cur = c->ui_progress;
+    if (cur < 0)
+        cur = gtk_entry_get_progress_fraction(GTK_ENTRY(c->location));
+    if (cur == p)
+        return;
+
+    c->ui_progress = p;
+    ui_schedule(c);
+}
+
+void
+ui_queue_title(gpointer data, const gchar *t)
+{
+    struct Client *c = (struct Client *)data;
+    const gchar *cur;
+
+    cur = c->ui_title;
+    if (cur == NULL)
+        cur = gtk_window_get_title(GTK_WINDOW(c->win));
+    if (g_strcmp0(cur, t) == 0)
+        return;
+
+    g_free(c->ui_title);
+    c->ui_title = g_strdup(t);
+    ui_schedule(c);
+}
+
+void
+ui_schedule(gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+
+    if (c->ui_tick == 0)
+        c->ui_tick = gtk_widget_add_tick_callback(c->win, ui_update, c, NULL);
+}
+
+gboolean
+ui_update(GtkWidget *widget, GdkFrameClock *frame_clock, gpointer data)
+{
+    struct Client *c = (struct Client *)data;
+
+    /* Values might have gone back and forth since they were queued, so
+     * compare against the widgets once more. */
+    if (c->ui_location != NULL)
+    {
+        if (strcmp(gtk_entry_get_text(GTK_ENTRY(c->location)), c->ui_location) != 0)
+            gtk_entry_set_text(GTK_ENTRY(c->location), c->ui_location);
+        g_free(c->ui_location);
+        c->ui_location = NULL;
+    }
+
+    if (c->ui_progress >= 0)
+    {
+        if (gtk_entry_get_progress_fraction(GTK_ENTRY(c->location)) != c->ui_progress)
+            gtk_entry_set_progress_fraction(GTK_ENTRY(c->location), c->ui_progress);
+        c->ui_progress = -1;
+    }
+
+    if (c->ui_title != NULL)
+    {
+        if (g_strcmp0(gtk_window_get_title(GTK_WINDOW(c->win)), c->ui_title) != 0)
+            gtk_window_set_title(GTK_WINDOW(c->win), c->ui_title);
+        g_free(c->ui_title);
+        c->ui_title = NULL;
+    }
+
+    c->ui_tick = 0;
+    return G_SOURCE_REMOVE;
+}
+
+void
+uri_cache_entry_free(gpointer data)
+{
+    struct UriCacheEntry *e = (struct UriCacheEntry *)data;
+
+    g_free(e->uri);
+    g_free(e);
+}
+
+gchar *
+uri_classify_lexical(const gchar *t)
+{
+    gchar *f, *host, *port;
+    gsize len;
+    gboolean obvious = FALSE;
+
+    /* Decide what t is without touching the file system. Returns NULL
+     * if we can't tell whether it's a local file or a host name. */
+
+    f = g_ascii_strdown(t, -1);
+    if (g_str_has_prefix(f, "http:") ||
+        g_str_has_prefix(f, "https:") ||
+        g_str_has_prefix(f, "file:") ||
+        g_str_has_prefix(f, "about:"))
+    {
+        g_free(f);
+        return g_strdup(t);
+    }
+
+    if (t[0] == '/')
+    {
+        g_free(f);
+        return g_strdup_printf("file://%s", t);
+    }
+
+    len = strcspn(f, "/?#");
+    host = g_strndup(f, len);
+    port = strrchr(host, ':');
+    if (port != NULL && port[1] != 0 && strspn(port + 1, "0123456789") ==
+        strlen(port + 1))
+    {
+        /* "foo:8080" -- Nobody names their files like that. */
+        obvious = TRUE;
+        *port = 0;
+    }
+    if (strcmp(host, "localhost") == 0 || g_str_has_prefix(host, "www."))
+        obvious = TRUE;
+    if (g_hostname_is_ip_address(host))
+        obvious = TRUE;
+    g_free(host);
+    g_free(f);
+
+    if (obvious)
+        return g_strdup_printf("http://%s", t);
+
+    return NULL;
+}
+
+gchar *
+uri_host(const gchar *uri)
+{
+    const gchar *p;
+    gchar *host, *at, *colon;
+
+    p = strstr(uri, "://");
+    if (p == NULL)
+        return NULL;
+    p += strlen("://");
+
+    host = g_ascii_strdown(p, strcspn(p, "/?#"));
+
+    at = strrchr(host, '@');
+    if (at != NULL)
+        memmove(host, at + 1, strlen(at + 1) + 1);
+
+    /* Leave IPv6 literals alone, they're full of colons. */
+    if (host[0] != '[')
+    {
+        colon = strchr(host, ':');
+        if (colon != NULL)
+            *colon = 0;
+    }
+
+    return host;
+}
+
+void
+uri_load(WebKitWebView *web_view, const gchar *t)
+{
+    struct UriCacheEntry *e;
+    struct UriProbe *p;
+    GTask *task;
+    gchar *f;
+
+    f = uri_classify_lexical(t);
+    if (f != NULL)
+    {
+        g_object_set_data(G_OBJECT(web_view), __NAME__"-uri-probe", NULL);
+        webkit_web_view_load_uri(web_view, f);
+        g_free(f);
+        return;
+    }
+
+    if (uri_cache != NULL)
+    {
+        e = g_hash_table_lookup(uri_cache, t);
+        if (e != NULL && e->expires > g_get_monotonic_time())
+        {
+            g_object_set_data(G_OBJECT(web_view), __NAME__"-uri-probe", NULL);
+            webkit_web_view_load_uri(web_view, e->uri);
+            return;
+        }
+    }
+
+    /* We have to ask the file system. Do it in a thread because that
+     * might block for a long time, e.g. on automounted NFS shares. One
+     * reference is held by the thread, one by the timeout. Whoever
+     * comes first gets to load the URI. */
+    p = g_new0(struct UriProbe, 1);
+    alloc_count(ALLOC_URI_PROBE, 1);
+    p->input = g_strdup(t);
+    p->refs = 2;
+    p->web_view = web_view;
+    g_object_add_weak_pointer(G_OBJECT(web_view), (gpointer *)&p->web_view);
+
+    /* Only the most recent request for a web view may load anything. */
+    g_object_set_data(G_OBJECT(web_view), __NAME__"-uri-probe", p);
+
+    p->timeout = g_timeout_add(uri_probe_timeout_ms, uri_probe_timeout, p);
+
+    task = g_task_new(NULL, NULL, uri_probe_done, p);
+    g_task_set_task_data(task, g_strdup(t), g_free);
+    g_task_run_in_thread(task, uri_probe_thread);
+    g_object_unref(task);
+}
+
+void
+uri_probe_deliver(gpointer data, const gchar *uri)
+{
+    struct UriProbe *p = (struct UriProbe *)data;
+
+    if (p->delivered)
+        return;
+    p->delivered = TRUE;
+
+    if (p->web_view != NULL &&
+        g_object_get_data(G_OBJECT(p->web_view), __NAME__"-uri-probe") == p)
+    {
+        g_object_set_data(G_OBJECT(p->web_view), __NAME__"-uri-probe", NULL);
+        webkit_web_view_load_uri(p->web_view, uri);
+    }
+}
+
+void
+uri_probe_done(GObject *obj, GAsyncResult *res, gpointer data)
+{
+    struct UriProbe *p = (struct UriProbe *)data;
+    struct UriCacheEntry *e;
+    gchar *f;
+
+    f = g_task_propagate_pointer(G_TASK(res), NULL);
+    if (f == NULL)
+        f = g_strdup_printf("http://%s", p->input);
+
+    if (uri_cache == NULL)
+        uri_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                          uri_cache_entry_free);
+    if (g_hash_table_size(uri_cache) >= uri_cache_max)
+    {
+        /* Entries are cheap to recompute. No need for anything fancy. */
+        g_hash_table_remove_all(uri_cache);
+    }
+
+    e = g_new(struct UriCacheEntry, 1);
+    e->uri = g_strdup(f);
+    e->expires = g_get_monotonic_time() + uri_cache_ttl;
+    g_hash_table_replace(uri_cache, g_strdup(p->input), e);
+
+    uri_probe_deliver(p, f);
+    g_free(f);
+
+    if (p->timeout != 0)
+    {
+        g_source_remove(p->timeout);
+        p->timeout = 0;
+        uri_probe_release(p);
+    }
+    uri_probe_release(p);
+}
+
+void
+uri_probe_release(gpointer data)
+{
+    struct UriProbe *p = (struct UriProbe *)data;
+
+    p->refs--;
+    if (p->refs > 0)
+        return;
+
+    if (p->web_view != NULL)
+    {
+        if (g_object_get_data(G_OBJECT(p->web_view), __NAME__"-uri-probe") == p)
+            g_object_set_data(G_OBJECT(p->web_view), __NAME__"-uri-probe", NULL);
+        g_object_remove_weak_pointer(G_OBJECT(p->web_view),
+                                     (gpointer *)&p->web_view);
+    }
+    g_free(p->input);
+    g_free(p);
+    alloc_count(ALLOC_URI_PROBE, -1);
+}
+
+void
+uri_probe_thread(GTask *task, gpointer source, gpointer task_data,
+                 GCancellable *cancellable)
+{
+    gchar *fabs, *f = NULL;
+
+    fabs = realpath((gchar *)task_data, NULL);
+    if (fabs != NULL)
+    {
+        f = g_strdup_printf("file://%s", fabs);
+        free(fabs);
+    }
+    g_task_return_pointer(task, f, g_free);
+}
+
+gboolean
+uri_probe_timeout(gpointer data)
+{
+    struct UriProbe *p = (struct UriProbe *)data;
+    gchar *f;
+
+    /* The file system didn't answer in time. Assume it's a host. The
+     * thread keeps running and will still fill the cache. */
+    f = g_strdup_printf("http://%s", p->input);
+    uri_probe_deliver(p, f);
+    g_free(f);
+
+    p->timeout = 0;
+    uri_probe_release(p);
+
+    return G_SOURCE_REMOVE;
+}
+
+gulong
+watchdog_connect(gpointer instance, const gchar *signal, GCallback cb,
+                 gpointer data, const gchar *name)
+{
+    GClosure *closure;
+
+    if (watchdog_threshold_us == 0)
+        return g_signal_connect_data(instance, signal, cb, data, NULL, 0);
+
+    closure = g_cclosure_new(cb, data, NULL);
+    g_closure_add_marshal_guards(closure, (gpointer)name, watchdog_enter,
+                                 (gpointer)name, watchdog_leave);
+    return g_signal_connect_closure(instance, signal, closure, FALSE);
+}
+
+void
+watchdog_dump(void)
+{
+    static const gchar *labels[12] = { "<1", "1", "2", "4", "8", "16", "32",
+                                       "64", "128", "256", "512", "1024+" };
+    GHashTableIter iter;
+    gpointer key, value;
+    struct WatchdogStats *st;
+    guint i;
+
+    fprintf(stderr, __NAME__": watchdog: callback, calls, total ms, max ms, "
+            "histogram (ms)\n");
+    g_hash_table_iter_init(&iter, watchdog_stats);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+        st = (struct WatchdogStats *)value;
+        fprintf(stderr, __NAME__": watchdog: %s %u %.1f %.1f", (gchar *)key,
+                st->count, st->total_us / 1e3, st->max_us / 1e3);
+        for (i = 0; i < G_N_ELEMENTS(st->histogram); i++)
+            if (st->histogram[i] > 0)
+                fprintf(stderr, " %s:%u", labels[i], st->histogram[i]);
+        fprintf(stderr, "\n");
+    }
+}
+
+void
+watchdog_enter(gpointer name, GClosure *closure)
+{
+    if (watchdog_threshold_us == 0)
+        return;
+
+    if (watchdog_depth < G_N_ELEMENTS(watchdog_started))
+        watchdog_started[watchdog_depth] = g_get_monotonic_time();
+    watchdog_depth++;
+}
+
+void
+watchdog_leave(gpointer name, GClosure *closure)
+{
+    gint64 us;
+
+    if (watchdog_threshold_us == 0 || watchdog_depth == 0)
+        return;
+
+    watchdog_depth--;
+    if (watchdog_depth >= G_N_ELEMENTS(watchdog_started))
+        return;
+
+    us = g_get_monotonic_time() - watchdog_started[watchdog_depth];
+    watchdog_record((const gchar *)name, us);
+    if (us > watchdog_threshold_us)
+        fprintf(stderr, __NAME__": watchdog: %s took %.1f ms\n",
+                (const gchar *)name, us / 1e3);
+}
+
+void
+watchdog_record(const gchar *name, gint64 us)
+{
+    struct WatchdogStats *st;
+    gint64 ms;
+    guint bucket = 0;
+
+    if (watchdog_stats == NULL)
+        watchdog_stats = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                               g_free);
+
+    /* Names are string literals, no need to copy them. */
+    st = g_hash_table_lookup(watchdog_stats, name);
+    if (st == NULL)
+    {
+        st = g_new0(struct WatchdogStats, 1);
+        g_hash_table_insert(watchdog_stats, (gpointer)name, st);
+    }
+
+    for (ms = us / 1000; ms > 0 && bucket < G_N_ELEMENTS(st->histogram) - 1;
+         ms /= 2)
+        bucket++;
+
+    st->count++;
+    st->histogram[bucket]++;
+    st->max_us = MAX(st->max_us, us);
+    st->total_us += us;
+}
+
+gboolean
+watchdog_tick(gpointer data)
+{
+    gint64 now, late;
+
+    /* If the main loop is busy, we're called late. That's how long the
+     * UI was unresponsive. */
+    now = g_get_monotonic_time();
+    late = now - watchdog_last_tick - watchdog_tick_ms * 1000;
+    late = MAX(late, 0);
+    watchdog_last_tick = now;
+
+    watchdog_record("(main loop)", late);
+    if (late > watchdog_threshold_us)
+        fprintf(stderr, __NAME__": watchdog: main loop stalled for %.1f ms\n",
+                late / 1e3);
+
+    return G_SOURCE_CONTINUE;
+}
+
+void
+web_context_setup(void)
+{
+    WebKitWebsiteDataManager *m;
+
+    if (cache_ephemeral)
+        web_context = webkit_web_context_new_ephemeral();
+    else if (cache_dir != NULL)
+    {
+        m = webkit_website_data_manager_new("disk-cache-directory", cache_dir,
+                                            NULL);
+        web_context = webkit_web_context_new_with_website_data_manager(m);
+        g_object_unref(m);
+    }
+    else
+        web_context = webkit_web_context_get_default();
+
+    webkit_web_context_set_cache_model(web_context, cache_model);
+
+    if (cache_size_max > 0 && !cache_ephemeral)
+    {
+        cache_trim(NULL);
+        g_timeout_add_seconds(cache_trim_interval, cache_trim, NULL);
+    }
 }
 
 
 int
 main(int argc, char **argv)
 {
-    gchar *c;
+    gchar *c, *f;
     int opt, i;
 
     gtk_init(&argc, &argv);
-    webkit_web_context_set_process_model(webkit_web_context_get_default(),
-        WEBKIT_PROCESS_MODEL_MULTIPLE_SECONDARY_PROCESSES);
 
     grab_environment_configuration();
+    web_context_setup();
 
-    while ((opt = getopt(argc, argv, "e:CT")) != -1)
+    while ((opt = getopt(argc, argv, "b:e:CT")) != -1)
     {
         switch (opt)
         {
+            case 'b':
+                batch_dir = optarg;
+                tabbed_automagic = FALSE;
+                break;
             case 'e':
                 embed = atol(optarg);
                 tabbed_automagic = FALSE;
@@ -1109,31 +4585,93 @@ main(int argc, char **argv)
     }
 
     keywords_load();
+    profiles_load();
     if (cooperative_instances)
         cooperation_setup();
     downloadmanager_setup();
 
+    if (batch_dir != NULL && cooperative_instances && !cooperative_alone)
+    {
+        /* Someone else is listening on the FIFO. We still want to do
+         * the job ourselves. */
+        close(cooperative_pipe_fp);
+        cooperative_instances = FALSE;
+    }
+
     if (tabbed_automagic && !(cooperative_instances && !cooperative_alone))
+    {
+        watchdog_enter("tabbed_launch", NULL);
         embed = tabbed_launch();
+        watchdog_leave("tabbed_launch", NULL);
+    }
 
     if (!cooperative_instances || cooperative_alone)
     {
         c = g_build_filename(g_get_user_config_dir(), __NAME__, "web_extensions",
                              NULL);
-        webkit_web_context_set_web_extensions_directory(
-            webkit_web_context_get_default(), c
-        );
+        webkit_web_context_set_web_extensions_directory(web_context, c);
+
+        /* Without the extension, we don't know the web processes. */
+        if (pagecache_budget_kb > 0)
+        {
+            f = g_build_filename(c, "we_adblock.so", NULL);
+            if (!g_file_test(f, G_FILE_TEST_EXISTS))
+                fprintf(stderr, __NAME__": Page cache budget needs %s\n", f);
+            g_free(f);
+        }
+        g_free(c);
+
+        adblock_load();
+        metrics_setup();
+        g_unix_signal_add(SIGUSR2, alloc_signal, NULL);
+
+        /* Only the instance that does the actual work writes a trace,
+         * the others would truncate the file. */
+        if (trace_file != NULL)
+            trace_init(trace_file, TRUE);
     }
 
-    if (optind >= argc)
-        client_new(home_uri, NULL, TRUE);
+    if (batch_dir != NULL)
+    {
+        /* Without any URIs, keep running and wait for the FIFO. */
+        batch_serve = optind >= argc && cooperative_instances;
+        for (i = optind; i < argc; i++)
+        {
+            if (strcmp(argv[i], "-") == 0 && !batch_input_open)
+            {
+                batch_input_open = TRUE;
+                g_io_add_watch(g_io_channel_unix_new(STDIN_FILENO),
+                               G_IO_IN | G_IO_HUP, (GIOFunc)batch_stdin, NULL);
+            }
+            else
+                batch_add(argv[i]);
+        }
+        g_idle_add(batch_check_done, NULL);
+    }
+    else if (optind >= argc)
+        client_new(home_uri, NULL, TRUE, FALSE);
     else
     {
         for (i = optind; i < argc; i++)
-            client_new(argv[i], NULL, TRUE);
+            client_new(argv[i], NULL, TRUE, FALSE);
     }
 
-    if (!cooperative_instances || cooperative_alone)
+    if (memory_interval > 0)
+        g_timeout_add_seconds(memory_interval, memory_sample, NULL);
+
+    if (watchdog_threshold_us > 0)
+    {
+        watchdog_last_tick = g_get_monotonic_time();
+        g_timeout_add(watchdog_tick_ms, watchdog_tick, NULL);
+    }
+
+    /* Blocked URIs don't get a window, so there might be none. */
+    if ((!cooperative_instances || cooperative_alone) &&
+        (batch_dir != NULL || clients > 0))
         gtk_main();
+
+    if (metrics_fifo != NULL)
+        unlink(metrics_fifo);
+
     exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,196 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib-unix.h>
+
+#include "trace.h"
+
+
+struct TraceEvent
+{
+    const gchar *cat;
+    const gchar *name;
+    gconstpointer id;
+    gchar arg[96];
+    gchar phase;
+    gint64 ts;
+};
+
+struct TraceRing
+{
+    struct TraceEvent events[8192];
+    guint flushed;
+    guint head;
+    struct TraceRing *next;
+    guint tid;
+};
+
+
+gboolean trace_enabled = FALSE;
+
+static int trace_fd = -1;
+static GMutex trace_flush_lock;
+static guint trace_next_tid = 1;
+static GPrivate trace_ring = G_PRIVATE_INIT(NULL);
+static struct TraceRing *trace_rings = NULL;
+
+
+static gboolean
+trace_flush_on_signal(gpointer data)
+{
+    trace_flush();
+    return G_SOURCE_CONTINUE;
+}
+
+static void
+trace_json_escape(GString *out, const gchar *s)
+{
+    for (; *s != 0; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            g_string_append_c(out, '\\');
+        if ((guchar)*s < 0x20)
+            g_string_append_printf(out, "\\u%04x", (guchar)*s);
+        else
+            g_string_append_c(out, *s);
+    }
+}
+
+static struct TraceRing *
+trace_ring_get(void)
+{
+    struct TraceRing *r;
+
+    r = g_private_get(&trace_ring);
+    if (r != NULL)
+        return r;
+
+    /* Each thread writes to its own ring without any locking. Rings are
+     * never freed, they are only ever added to the list. */
+    r = g_new0(struct TraceRing, 1);
+    r->tid = g_atomic_int_add(&trace_next_tid, 1);
+    do
+        r->next = g_atomic_pointer_get(&trace_rings);
+    while (!g_atomic_pointer_compare_and_exchange(&trace_rings, r->next, r));
+
+    g_private_set(&trace_ring, r);
+    return r;
+}
+
+void
+trace_event(gchar phase, const gchar *cat, const gchar *name, gconstpointer id,
+            const gchar *arg)
+{
+    struct TraceRing *r;
+    struct TraceEvent *e;
+    guint head;
+
+    if (!trace_enabled)
+        return;
+
+    r = trace_ring_get();
+    head = g_atomic_int_get(&r->head);
+    e = &r->events[head % G_N_ELEMENTS(r->events)];
+
+    e->cat = cat;
+    e->name = name;
+    e->id = id;
+    e->phase = phase;
+    e->ts = g_get_monotonic_time();
+    if (arg != NULL)
+        g_strlcpy(e->arg, arg, sizeof e->arg);
+    else
+        e->arg[0] = 0;
+
+    /* Publish the event only after it has been written completely. */
+    g_atomic_int_set(&r->head, head + 1);
+}
+
+void
+trace_flush(void)
+{
+    struct TraceRing *r;
+    struct TraceEvent e;
+    GString *out;
+    guint head, i, size;
+    int pid = (int)getpid();
+
+    if (!trace_enabled)
+        return;
+
+    g_mutex_lock(&trace_flush_lock);
+
+    out = g_string_new(NULL);
+    for (r = g_atomic_pointer_get(&trace_rings); r != NULL; r = r->next)
+    {
+        head = g_atomic_int_get(&r->head);
+        size = G_N_ELEMENTS(r->events);
+
+        /* Events that have been overwritten are lost. The slot at head
+         * is the one the thread writes to next, it may be half done. */
+        i = head - r->flushed >= size ? head - size + 1 : r->flushed;
+        for (; i != head; i++)
+        {
+            /* The thread keeps going while we read. If it has reached
+             * this slot again in the meantime, our copy may be garbage. */
+            e = r->events[i % size];
+            if (g_atomic_int_get(&r->head) - i >= size)
+                continue;
+            g_string_append_printf(out,
+                                   "{\"ph\":\"%c\",\"cat\":\"%s\",\"name\":\"%s\","
+                                   "\"ts\":%"G_GINT64_FORMAT",\"pid\":%d,\"tid\":%u",
+                                   e.phase, e.cat, e.name, e.ts, pid, r->tid);
+            if (e.id != NULL)
+                g_string_append_printf(out, ",\"id\":\"%p\"", e.id);
+            if (e.phase == 'i')
+                g_string_append(out, ",\"s\":\"t\"");
+            if (e.arg[0] != 0)
+            {
+                g_string_append(out, ",\"args\":{\"arg\":\"");
+                trace_json_escape(out, e.arg);
+                g_string_append(out, "\"}");
+            }
+            g_string_append(out, "},\n");
+        }
+        r->flushed = head;
+    }
+
+    /* Several processes append to the same file. One write() per flush
+     * keeps their events from getting mixed up. */
+    if (out->len > 0 && write(trace_fd, out->str, out->len) == -1)
+        perror(__NAME__": Could not write trace file");
+    g_string_free(out, TRUE);
+
+    g_mutex_unlock(&trace_flush_lock);
+}
+
+void
+trace_init(const gchar *path, gboolean truncate)
+{
+    int flags = O_WRONLY | O_CREAT | O_APPEND;
+
+    if (truncate)
+        flags |= O_TRUNC;
+
+    trace_fd = open(path, flags, 0600);
+    if (trace_fd == -1)
+    {
+        perror(__NAME__": Could not open trace file");
+        return;
+    }
+
+    /* The trace event format allows leaving out the closing bracket,
+     * which means everybody can simply keep appending events. */
+    if (truncate && write(trace_fd, "[\n", 2) == -1)
+        perror(__NAME__": Could not write trace file");
+
+    trace_enabled = TRUE;
+
+    g_unix_signal_add(SIGUSR1, trace_flush_on_signal, NULL);
+    atexit(trace_flush);
+}
@@ -0,0 +1,18 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <glib.h>
+
+
+/* Phases as defined by Chrome's trace event format: 'B'egin and 'E'nd of
+ * a synchronous event, 'b'egin and 'e'nd of an asynchronous event (these
+ * need an ID, other events may carry one) and 'i'nstant events. Category
+ * and name must be string literals, the argument is copied. */
+void trace_event(gchar, const gchar *, const gchar *, gconstpointer,
+                 const gchar *);
+void trace_flush(void);
+void trace_init(const gchar *, gboolean);
+
+extern gboolean trace_enabled;
+
+#endif
@@ -1,81 +1,223 @@
+#include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <glib.h>
 #include <webkit2/webkit-web-extension.h>
 
+#include "adblock.h"
+#include "trace.h"
 
-static GSList *adblock_patterns = NULL;
 
+struct PageMetrics
+{
+    guint requests;
+    guint blocked;
+    gint64 match_us;
+};
+
+
+static int metrics_fd = -1;
+static const guint metrics_interval = 500;
+static GHashTable *metrics_pages = NULL;
+static guint metrics_timer = 0;
+static const guint trace_interval = 5;
+
+
+static gboolean
+metrics_flush(gpointer data)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    struct PageMetrics *m;
+    gchar line[128];
+    int len;
+
+    metrics_timer = 0;
+
+    /* One line per page. Lines are way shorter than PIPE_BUF, so they
+     * don't get mixed up with those of other web processes. */
+    g_hash_table_iter_init(&iter, metrics_pages);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+        m = (struct PageMetrics *)value;
+        len = snprintf(line, sizeof line,
+                       "%"G_GUINT64_FORMAT" %u %u %"G_GINT64_FORMAT"\n",
+                       *(guint64 *)key, m->requests, m->blocked, m->match_us);
+        if (write(metrics_fd, line, len) == -1)
+            break;
+    }
+    g_hash_table_remove_all(metrics_pages);
+
+    return G_SOURCE_REMOVE;
+}
 
 static void
-adblock_load(void)
+metrics_record(WebKitWebPage *web_page, gboolean blocked, gint64 match_us)
 {
-    GRegex *re = NULL;
-    GError *err = NULL;
-    GIOChannel *channel = NULL;
-    gchar *path = NULL, *buf = NULL;
-
-    path = g_build_filename(g_get_user_config_dir(), __NAME__, "adblock.black",
-                            NULL);
-    channel = g_io_channel_new_file(path, "r", &err);
-    if (channel != NULL)
+    struct PageMetrics *m;
+    guint64 id, *key;
+
+    if (metrics_fd == -1)
+        return;
+
+    id = webkit_web_page_get_id(web_page);
+    m = g_hash_table_lookup(metrics_pages, &id);
+    if (m == NULL)
     {
-        while (g_io_channel_read_line(channel, &buf, NULL, NULL, NULL)
-               == G_IO_STATUS_NORMAL)
-        {
-            g_strstrip(buf);
-            if (buf[0] != '#')
-            {
-                re = g_regex_new(buf,
-                                 G_REGEX_CASELESS | G_REGEX_OPTIMIZE,
-                                 G_REGEX_MATCH_PARTIAL, &err);
-                if (err != NULL)
-                {
-                    fprintf(stderr, __NAME__": Could not compile regex: %s\n", buf);
-                    g_error_free(err);
-                    err = NULL;
-                }
-                else
-                    adblock_patterns = g_slist_append(adblock_patterns, re);
-            }
-            g_free(buf);
-        }
-        g_io_channel_shutdown(channel, FALSE, NULL);
+        m = g_new0(struct PageMetrics, 1);
+        key = g_new(guint64, 1);
+        *key = id;
+        g_hash_table_insert(metrics_pages, key, m);
     }
-    g_free(path);
+
+    m->requests++;
+    m->blocked += blocked ? 1 : 0;
+    m->match_us += match_us;
+
+    /* Aggregate and only report every now and then. */
+    if (metrics_timer == 0)
+        metrics_timer = g_timeout_add(metrics_interval, metrics_flush, NULL);
+}
+
+static void
+metrics_setup(const GVariant *user_data)
+{
+    GVariant *v = (GVariant *)user_data;
+
+    if (v == NULL || !g_variant_is_of_type(v, G_VARIANT_TYPE_STRING))
+        return;
+
+    metrics_fd = open(g_variant_get_string(v, NULL),
+                      O_WRONLY | O_NONBLOCK);
+    if (metrics_fd == -1)
+        return;
+
+    metrics_pages = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free,
+                                          g_free);
+}
+
+static gboolean
+trace_flush_periodically(gpointer data)
+{
+    trace_flush();
+    return G_SOURCE_CONTINUE;
+}
+
+static void
+web_page_document_loaded(WebKitWebPage *web_page, gpointer user_data)
+{
+    g_object_set_data(G_OBJECT(web_page), "document-uri", NULL);
+}
+
+static guint
+web_page_request_type(WebKitWebPage *web_page, WebKitURIRequest *request,
+                      WebKitURIResponse *redirected_response)
+{
+    SoupMessageHeaders *headers;
+    const gchar *accept, *pending, *uri, *page_uri;
+
+    uri = webkit_uri_request_get_uri(request);
+    page_uri = webkit_web_page_get_uri(web_page);
+
+    /* While the main resource is requested, the page still has the URI
+     * of the previous document. But WebKit asks for HTML when it loads
+     * a frame. The first of those requests after the previous document
+     * has been loaded is the main frame's, as are its redirects. Other
+     * ones are for iframes. */
+    headers = webkit_uri_request_get_http_headers(request);
+    accept = headers != NULL ? soup_message_headers_get_one(headers, "Accept")
+                             : NULL;
+    if (accept == NULL || !g_str_has_prefix(accept, "text/html"))
+        return adblock_type_guess(uri, page_uri);
+
+    pending = g_object_get_data(G_OBJECT(web_page), "document-uri");
+    if (pending != NULL &&
+        (redirected_response == NULL ||
+         strcmp(webkit_uri_response_get_uri(redirected_response), pending) != 0))
+        return ADBLOCK_SUBDOCUMENT;
+
+    g_object_set_data_full(G_OBJECT(web_page), "document-uri", g_strdup(uri),
+                           g_free);
+    return ADBLOCK_DOCUMENT;
 }
 
 static gboolean
 web_page_send_request(WebKitWebPage *web_page, WebKitURIRequest *request,
                       WebKitURIResponse *redirected_response, gpointer user_data)
 {
-    GSList *it = adblock_patterns;
-    const gchar *uri;
+    const gchar *uri, *page_uri;
+    gint64 start;
+    gboolean blocked;
+    guint type;
 
     uri = webkit_uri_request_get_uri(request);
+    page_uri = webkit_web_page_get_uri(web_page);
+    start = g_get_monotonic_time();
+    trace_event('B', "adblock", "match", NULL, uri);
 
-    while (it)
-    {
-        if (g_regex_match((GRegex *)(it->data), uri, 0, NULL))
-            return TRUE;
-        it = g_slist_next(it);
-    }
+    /* Like lariza does, match a new document on its own. */
+    type = web_page_request_type(web_page, request, redirected_response);
+    if (type == ADBLOCK_DOCUMENT)
+        page_uri = NULL;
+    blocked = adblock_match(uri, page_uri, type);
+
+    /* There won't be a "document-loaded" for a blocked document. */
+    if (blocked && type == ADBLOCK_DOCUMENT)
+        g_object_set_data(G_OBJECT(web_page), "document-uri", NULL);
+
+    metrics_record(web_page, blocked, g_get_monotonic_time() - start);
+    trace_event('E', "adblock", "match", NULL, NULL);
+    if (blocked)
+        trace_event('i', "adblock", "blocked", NULL, uri);
 
-    return FALSE;
+    return blocked;
 }
 
 static void
 web_page_created_callback(WebKitWebExtension *extension, WebKitWebPage *web_page,
                           gpointer user_data)
 {
+    gchar line[64];
+    int len;
+
+    /* Tell lariza which process this page lives in. */
+    if (metrics_fd != -1)
+    {
+        len = snprintf(line, sizeof line, "pid %"G_GUINT64_FORMAT" %d\n",
+                       webkit_web_page_get_id(web_page), (int)getpid());
+        if (write(metrics_fd, line, len) == -1)
+            perror(__NAME__": Could not write to metrics FIFO");
+    }
+
     g_signal_connect_object(web_page, "send-request",
                             G_CALLBACK(web_page_send_request), NULL, 0);
+    g_signal_connect_object(web_page, "document-loaded",
+                            G_CALLBACK(web_page_document_loaded), NULL, 0);
 }
 
 G_MODULE_EXPORT void
-webkit_web_extension_initialize(WebKitWebExtension *extension)
+webkit_web_extension_initialize_with_user_data(WebKitWebExtension *extension,
+                                               const GVariant *user_data)
 {
+    const gchar *e;
+
+    /* lariza creates the file and our events get appended to it. */
+    e = g_getenv(__NAME_UPPERCASE__"_TRACE_FILE");
+    if (e != NULL)
+    {
+        trace_init(e, FALSE);
+
+        /* Web processes usually get killed instead of exiting, so
+         * don't rely on atexit(). */
+        if (trace_enabled)
+            g_timeout_add_seconds(trace_interval, trace_flush_periodically,
+                                  NULL);
+    }
+
     adblock_load();
+    metrics_setup(user_data);
     g_signal_connect(extension, "page-created",
                      G_CALLBACK(web_page_created_callback), NULL);
 }